@@ -0,0 +1,161 @@
+#include "animation.h"
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace animation {
+
+using common::LightSetting;
+
+namespace {
+
+uint8_t mix(uint8_t from, uint8_t to, double ratio) {
+	return static_cast<uint8_t>(std::lround(from + (to - from) * ratio));
+}
+
+LightSetting mix(const LightSetting& from, const LightSetting& to, double ratio) {
+	return LightSetting{mix(from.r, to.r, ratio), mix(from.g, to.g, ratio),
+		mix(from.b, to.b, ratio)};
+}
+
+} // namespace
+
+LedAnimator::LedAnimator(common::RgbLight& led,
+		std::chrono::milliseconds fadeDuration, unsigned int framesPerSecond) :
+	led(led),
+	fadeDuration(fadeDuration),
+	tick(std::chrono::nanoseconds(common::GIGA / framesPerSecond)),
+	timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)),
+	eventFd(eventfd(0, EFD_CLOEXEC)),
+	target(led.get()),
+	from(target),
+	to(target),
+	shown(target) {
+
+	if (timerFd < 0 || eventFd < 0) {
+		close(timerFd);
+		close(eventFd);
+		throw std::runtime_error("creating timerfd or eventfd failed");
+	}
+	thread = std::thread(&LedAnimator::run, this);
+}
+
+LedAnimator::~LedAnimator() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	uint64_t one = 1;
+	if (write(eventFd, &one, sizeof(one)) != sizeof(one))
+		printf("ERROR while stopping the LED animator.\n");
+	thread.join();
+	close(timerFd);
+	close(eventFd);
+}
+
+void LedAnimator::set(LightSetting value) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		target = value;
+		targetPending = true;
+		animating = true;
+	}
+	uint64_t one = 1;
+	if (write(eventFd, &one, sizeof(one)) != sizeof(one))
+		printf("ERROR while queueing an animation.\n");
+}
+
+LightSetting LedAnimator::get() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return target;
+}
+
+void LedAnimator::waitIdle() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [&]() { return !animating; });
+}
+
+LedAnimator::Stats LedAnimator::getStats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void LedAnimator::run() {
+	struct pollfd fds[2] = {
+		{eventFd, POLLIN, 0},
+		{timerFd, POLLIN, 0}
+	};
+	while (1) {
+		if (::poll(fds, 2, -1) < 0)
+			continue; // EINTR
+
+		uint64_t count;
+		bool ticked = (fds[1].revents & POLLIN) &&
+			read(timerFd, &count, sizeof(count)) == sizeof(count);
+		bool restarted = false;
+		if ((fds[0].revents & POLLIN) &&
+				read(eventFd, &count, sizeof(count)) == sizeof(count)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				break;
+			if (targetPending) {
+				from = shown;
+				to = target;
+				start = Clock::now();
+				targetPending = false;
+				restarted = true;
+			}
+		}
+		if (!ticked && !restarted)
+			continue;
+
+		bool done;
+		LightSetting frame = frameAt(Clock::now(), done);
+		bool changed = frame != shown;
+		if (changed) {
+			led.set(frame);
+			shown = frame;
+		}
+		if (restarted || done)
+			setTimer(!done);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (ticked)
+			stats.ticks++;
+		if (changed)
+			stats.framesPushed++;
+		else
+			stats.framesSkipped++;
+		if (done && !targetPending) {
+			animating = false;
+			idle.notify_all();
+		}
+	}
+	setTimer(false);
+}
+
+LightSetting LedAnimator::frameAt(Clock::time_point now, bool& done) const {
+	double elapsed = std::chrono::duration<double>(now - start).count();
+	double fade = std::chrono::duration<double>(fadeDuration).count();
+	double ratio = (fade > 0) ? elapsed / fade : 1;
+	done = ratio >= 1;
+	return done ? to : mix(from, to, ratio);
+}
+
+void LedAnimator::setTimer(bool running) {
+	struct itimerspec timer{};
+	if (running) {
+		timer.it_interval.tv_sec = tick.count() / common::GIGA;
+		timer.it_interval.tv_nsec = tick.count() % common::GIGA;
+		timer.it_value = timer.it_interval;
+	}
+	timerfd_settime(timerFd, 0, &timer, nullptr);
+}
+
+} // namespace animation
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+
+namespace animation {
+
+/**
+ * Animates an RgbLight from its own thread on a fixed-rate timerfd tick:
+ * set() cross-fades from the colour shown to the new one. Frames equal to
+ * the last one pushed are skipped, and the timer is stopped whenever the
+ * light is static, so an idle animator costs nothing.
+ */
+class LedAnimator : public common::RgbLight {
+public:
+	using Clock = std::chrono::steady_clock; // CLOCK_MONOTONIC
+
+	struct Stats {
+		size_t ticks{0};
+		size_t framesPushed{0};
+		size_t framesSkipped{0}; // unchanged
+	};
+
+	LedAnimator(common::RgbLight& led,
+			std::chrono::milliseconds fadeDuration = std::chrono::milliseconds(300),
+			unsigned int framesPerSecond = 100);
+	~LedAnimator();
+
+	LedAnimator(const LedAnimator&) = delete;
+	LedAnimator& operator=(const LedAnimator&) = delete;
+
+	void set(common::LightSetting value) override;
+
+	/**
+	 * The colour faded to, not the frame shown.
+	 */
+	common::LightSetting get() override;
+
+	/**
+	 * Waits until a fade has ended.
+	 */
+	void waitIdle();
+
+	Stats getStats();
+
+private:
+	void run();
+	common::LightSetting frameAt(Clock::time_point now, bool& done) const;
+	void setTimer(bool running);
+
+	common::RgbLight& led;
+	std::chrono::milliseconds fadeDuration;
+	std::chrono::nanoseconds tick;
+	int timerFd;
+	int eventFd;
+
+	std::mutex mutex;
+	std::condition_variable idle;
+	common::LightSetting target;
+	bool targetPending{false};
+	bool animating{false};
+	bool stopping{false};
+	Stats stats;
+
+	// Thread only.
+	common::LightSetting from;
+	common::LightSetting to;
+	Clock::time_point start;
+	common::LightSetting shown;
+
+	std::thread thread;
+};
+
+} // namespace animation
@@ -1,25 +1,99 @@
 #include "common.h"
+#include "animation.h"
 #include "pwm.h"
 #include "network.h"
+#include "uring.h"
 #include "filesystem.h"
+#include "pipeline.h"
+#include "parsers.h"
+#include "rules.h"
+
+#include <cstdio>
+#include <fstream>
 
 using namespace std;
 
 static const uint16_t LISTEN_PORT{5555};
 static const string PWM_BASE_PATH = "/sys/class/pwm";
 static const string STORE_FILE =  "/var/local/ciSpy-store";
+static const string UNIX_SOCKET_PATH = "/var/run/ciSpy.sock";
+static const string RULES_FILE = "/etc/ciSpy/rules";
+static const size_t EVENT_QUEUE_LEN{256};
+static const chrono::milliseconds COALESCING_WINDOW{20};
+static const size_t DEDUP_SLOTS{1024};
+static const chrono::milliseconds DEDUP_WINDOW{10000};
+static const size_t JOBS_MAX{4096};
+
+using AdmissionQueue = pipeline::AdmissionQueue<EVENT_QUEUE_LEN>;
+using EventQueue = pipeline::FanInQueue<common::BuildEvent, EVENT_QUEUE_LEN,
+	  AdmissionQueue>;
+
+/**
+ * Network thread, the single producer of its admission queue. With several
+ * acceptors, each has its own SO_REUSEPORT listen socket; the first one also
+ * serves UDP and local datagrams. All share the deduplicator, since the
+ * kernel hands each retry to any of them.
+ */
+static void runAcceptor(AdmissionQueue& events,
+		pipeline::Deduplicator& deduplicator,
+		shared_ptr<const rules::RuleSet> statusRules, bool reusePort,
+		bool serveDatagrams) {
+	parsers::DefaultParsers buildResultParsers{statusRules};
+	parsers::ParserRegistry& buildResultParser = buildResultParsers.getRegistry();
+	auto ingest = [&](common::StringView msg) {
+		// Retried deliveries must not beep or rewrite the store again.
+		if (!deduplicator.admit(msg))
+			return;
+		events.push(buildResultParser.parseEvent(msg));
+	};
+
+	// io_uring where the kernel has it, epoll otherwise.
+	auto tcpServer = network::makeTcpServer(LISTEN_PORT, ingest,
+			network::Framing::HTTP, reusePort);
+	if (!serveDatagrams) {
+		tcpServer->run();
+		return;
+	}
+
+	network::DatagramReceiver udpReceiver{LISTEN_PORT, ingest};
+	network::DatagramReceiver unixReceiver{UNIX_SOCKET_PATH, ingest};
+	tcpServer->watch(udpReceiver.getFd(), [&]() { udpReceiver.receive(); });
+	tcpServer->watch(unixReceiver.getFd(), [&]() { unixReceiver.receive(); });
+	tcpServer->run();
+}
+
+/**
+ * Usage: ciSpy [number of acceptor threads]
+ */
+int main(int argc, char* argv[]) {
+	int acceptors = (argc > 1) ? atoi(argv[1]) : 1;
+	if (acceptors < 1)
+		acceptors = 1;
+
+	// The status rules are shared by all acceptors and reloaded from
+	// RULES_FILE on change or SIGHUP, without restarting.
+	rules::RuleFileReloader::blockReloadSignal();
+	auto statusRules = make_shared<rules::RuleSet>(
+			parsers::defaultStatusRules());
+	rules::RuleFileReloader ruleReloader{*statusRules, RULES_FILE};
+	if (ifstream(RULES_FILE))
+		ruleReloader.reload();
+	thread reloader([&]() { ruleReloader.run(); });
 
-int main(void) {
 	pwm::LinuxPwmOutput pwmBeeper{ PWM_BASE_PATH, 0, 0 };
 	pwm::LinuxPwmOutput pwmBlue{ PWM_BASE_PATH, 1, 0 };
 	pwm::LinuxPwmOutput pwmGreen{ PWM_BASE_PATH, 2, 0 };
 	pwm::LinuxPwmOutput pwmRed{ PWM_BASE_PATH, 3, 0 };
 
-	auto sleepFunction = [](uint16_t duration_ms) {
-		this_thread::sleep_for(chrono::milliseconds(duration_ms));
-	};
-	pwm::PwmBeeper beeper(pwmBeeper, sleepFunction);
-	pwm::PwmRgbLed led(pwmRed, pwmGreen, pwmBlue);
+	// Tones play from their own thread, colour changes fade from another
+	// and are written behind, so signalling does not hold up the actuator.
+	pwm::ToneSequencer beeper{pwmBeeper};
+	pwm::PwmWorker pwmWorker;
+	pwm::AsyncPwmOutput asyncRed{pwmRed, pwmWorker};
+	pwm::AsyncPwmOutput asyncGreen{pwmGreen, pwmWorker};
+	pwm::AsyncPwmOutput asyncBlue{pwmBlue, pwmWorker};
+	pwm::BasicPwmRgbLed<pwm::GammaCalibration> pwmLed(asyncRed, asyncGreen, asyncBlue);
+	animation::LedAnimator led{pwmLed};
 	common::Signalizer signalizer{beeper, led};
 
 	filesystem::FileStreamFactory fac;
@@ -27,15 +101,56 @@ int main(void) {
 	common::StateSaver stateSaver{fileStore, led};
 	stateSaver.restoreLightSetting();
 
-	network::TcpServer tcpServer{LISTEN_PORT};
-	common::JenkinsBuildResultParser buildResultParser;
+	// Signalling runs in its own thread and must never hold up the network
+	// threads.
+	EventQueue events(acceptors);
+	thread actuator([&]() {
+		pipeline::JobTable jobs{JOBS_MAX};
+		signalizer.setStatistics(&jobs);
+		pipeline::Coalescer coalescer{COALESCING_WINDOW};
+		auto apply = [&](common::BuildResult result) {
+			signalizer.update(result);
+			stateSaver.saveCurrentLightSetting();
+		};
+
+		common::BuildEvent event;
+		size_t shedReported = 0;
+		while(1) {
+			// A job turning green must not hide another job's failure, so
+			// the light follows the aggregate over all jobs.
+			if (!coalescer.isPending()) {
+				events.waitPop(event);
+				coalescer.add(jobs.update(event));
+			} else if (events.waitPopUntil(event, coalescer.getDeadline())) {
+				coalescer.add(jobs.update(event));
+			}
+
+			if (!coalescer.isDue())
+				continue;
+			coalescer.flush(apply);
+
+			size_t shed = events.getDroppedCount();
+			if (shed != shedReported) {
+				printf("Shed %zu build events under load.\n", shed - shedReported);
+				shedReported = shed;
+			}
+		}
+	});
 
-	while(1) {
-		auto msg = tcpServer.receiveClientMsg();
-		auto result = buildResultParser.parseMsg(msg);
-		signalizer.update(result);
-		stateSaver.saveCurrentLightSetting();
+	pipeline::Deduplicator deduplicator{DEDUP_SLOTS, DEDUP_WINDOW};
+	bool reusePort = acceptors > 1;
+	vector<thread> acceptorThreads;
+	for (int i = 1; i < acceptors; i++) {
+		acceptorThreads.emplace_back(runAcceptor,
+				ref(events.getProducerQueue(i)), ref(deduplicator), statusRules,
+				reusePort, false);
 	}
+	runAcceptor(events.getProducerQueue(0), deduplicator, statusRules,
+			reusePort, true);
 
+	for (auto& t : acceptorThreads)
+		t.join();
+	actuator.join();
+	reloader.join();
 	return 0;
 }
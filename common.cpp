@@ -1,9 +1,52 @@
 #include "common.h"
 #include "pwm.h"
 #include "strings.h"
+#include "json.h"
+#include "rules.h"
 
 namespace common {
 
+const size_t StringView::npos;
+const unsigned JobStatistics::WINDOW_LEN;
+
+size_t StringView::find(char c, size_t pos) const {
+	if (pos >= len)
+		return npos;
+	auto found = static_cast<const char*>(memchr(ptr + pos, c, len - pos));
+	return found ? found - ptr : npos;
+}
+
+size_t StringView::find(StringView str, size_t pos) const {
+	if (pos > len)
+		return npos;
+	auto found = static_cast<const char*>(
+			memmem(ptr + pos, len - pos, str.data(), str.size()));
+	return found ? found - ptr : npos;
+}
+
+bool StringView::startsWith(StringView prefix) const {
+	return (len >= prefix.size() &&
+			memcmp(ptr, prefix.data(), prefix.size()) == 0);
+}
+
+bool operator==(StringView lhs, StringView rhs) {
+	return (lhs.size() == rhs.size() &&
+			memcmp(lhs.data(), rhs.data(), lhs.size()) == 0);
+}
+
+bool operator!=(StringView lhs, StringView rhs) {
+	return !(lhs == rhs);
+}
+
+uint64_t fingerprint(StringView s) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (char c : s) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash ? hash : 1;
+}
+
 bool operator==(const LightSetting& lhs, const LightSetting& rhs) {
 	return (lhs.r == rhs.r &&
 			lhs.g == rhs.g &&
@@ -30,7 +73,10 @@ Signalizer::Signalizer(Beeper& beeper, RgbLight& rgbLight) :
 
 void Signalizer::update(BuildResult buildResult) {
 	if (buildResult == BuildResult::OK) {
-		rgbLight.set(LightSetting{0, 255, 0});
+		if (statistics && statistics->getFlakyJobCount() > 0)
+			rgbLight.set(LightSetting{255, 128, 0});
+		else
+			rgbLight.set(LightSetting{0, 255, 0});
 	} else if (buildResult == BuildResult::BROKEN) {
 		rgbLight.set(LightSetting{255, 0, 0});
 
@@ -41,12 +87,89 @@ void Signalizer::update(BuildResult buildResult) {
 	}
 }
 
-BuildResult JenkinsBuildResultParser::parseMsg(const std::string& msg) {
-	if (msg.find("SUCCESS") != std::string::npos)
-		return BuildResult::OK;
-	else if (msg.find("FAILURE") != std::string::npos)
-		return BuildResult::BROKEN;
-	return BuildResult::DONTKNOW;
+void Signalizer::setStatistics(const BuildStatistics* statistics) {
+	this->statistics = statistics;
+}
+
+JenkinsBuildResultParser::JenkinsBuildResultParser() :
+	JenkinsBuildResultParser({
+		{"SUCCESS", BuildResult::OK},
+		{"FAILURE", BuildResult::BROKEN}}) {
+}
+
+JenkinsBuildResultParser::JenkinsBuildResultParser(
+		const std::vector<rules::Rule>& statusRules) :
+	JenkinsBuildResultParser(std::make_shared<rules::RuleSet>(statusRules)) {
+}
+
+JenkinsBuildResultParser::JenkinsBuildResultParser(
+		std::shared_ptr<const rules::RuleSet> statusRules) :
+	JenkinsBuildResultParser(statusRules, statusRules) {
+}
+
+JenkinsBuildResultParser::JenkinsBuildResultParser(
+		std::shared_ptr<const rules::RuleSet> statusRules,
+		std::shared_ptr<const rules::RuleSet> rawRules) :
+	statusRules(statusRules),
+	rawRules(rawRules) {
+}
+
+BuildResult JenkinsBuildResultParser::parseMsg(StringView msg) {
+	return parseEvent(msg).result;
+}
+
+namespace {
+
+StringView xmlElement(StringView msg, StringView startTag) {
+	size_t tag = msg.find(startTag);
+	if (tag == StringView::npos)
+		return StringView{};
+	StringView content = msg.substr(tag + startTag.size());
+	return content.substr(0, content.find('<'));
+}
+
+} // namespace
+
+BuildEvent JenkinsBuildResultParser::parseEvent(StringView msg) {
+	StringView status = msg;
+	StringView name;
+	const rules::RuleSet* rules = rawRules.get();
+	JenkinsNotification notification;
+	if (parseJson(msg, notification)) {
+		status = notification.status;
+		name = notification.name;
+		rules = statusRules.get();
+	} else if (msg.find("<status>") != StringView::npos) {
+		status = xmlElement(msg, "<status>");
+		name = xmlElement(msg, "<name>");
+		rules = statusRules.get();
+	}
+
+	BuildEvent event;
+	rules->classify(status, event.result);
+	if (!name.empty())
+		event.job = fingerprint(name);
+	return event;
+}
+
+bool JenkinsBuildResultParser::parseJson(StringView msg,
+		JenkinsNotification& notification) {
+	static const json::FieldPath FIELDS[] = {
+		{"", "name"},
+		{"build", "phase"},
+		{"build", "status"},
+		{"build", "number"}
+	};
+	StringView values[4];
+	if (!json::extractFields(msg, FIELDS, 4, values))
+		return false;
+
+	notification.name = values[0];
+	notification.phase = values[1];
+	notification.status = values[2];
+	if (!json::JsonReader::toInt(values[3], notification.number))
+		notification.number = -1;
+	return true;
 }
 
 StateSaver::StateSaver(KeyValueStore& store, RgbLight& rgbLight) :
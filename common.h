@@ -4,16 +4,81 @@
 #include <cstdlib>
 #include <ctime>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <exception>
 #include <stdexcept>
 #include <thread>
 #include <chrono>
+#include <memory>
+#include <vector>
+
+namespace rules {
+struct Rule;
+class RuleSet;
+}
 
 namespace common {
 
 const unsigned long GIGA{1000000000UL};
 
+/**
+ * Non-owning view of a character sequence, modelled after the subset of
+ * C++17 std::string_view needed here. The viewed memory must outlive it.
+ */
+class StringView {
+public:
+	static const size_t npos{static_cast<size_t>(-1)};
+
+	StringView() {
+	}
+
+	StringView(const char* data, size_t size) :
+		ptr(data),
+		len(size) {
+	}
+
+	StringView(const char* str) :
+		StringView(str, strlen(str)) {
+	}
+
+	StringView(const std::string& str) :
+		StringView(str.data(), str.size()) {
+	}
+
+	const char* data() const { return ptr; }
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+	const char* begin() const { return ptr; }
+	const char* end() const { return ptr + len; }
+	char operator[](size_t pos) const { return ptr[pos]; }
+
+	StringView substr(size_t pos, size_t count = npos) const {
+		if (pos > len)
+			pos = len;
+		if (count > len - pos)
+			count = len - pos;
+		return StringView(ptr + pos, count);
+	}
+
+	size_t find(char c, size_t pos = 0) const;
+	size_t find(StringView str, size_t pos = 0) const;
+	bool startsWith(StringView prefix) const;
+	std::string toString() const { return std::string(ptr, len); }
+
+private:
+	const char* ptr{""};
+	size_t len{0};
+};
+
+bool operator==(StringView lhs, StringView rhs);
+bool operator!=(StringView lhs, StringView rhs);
+
+/**
+ * 64-bit FNV-1a hash, never 0.
+ */
+uint64_t fingerprint(StringView s);
+
 class LightSetting {
 public:
 	LightSetting() : LightSetting(0, 0, 0) {
@@ -73,23 +138,135 @@ enum class BuildResult {
 	DONTKNOW
 };
 
+/**
+ * A parsed build notification as passed between pipeline stages.
+ */
+struct BuildEvent {
+	BuildEvent(BuildResult result) :
+		result(result) {
+	}
+
+	BuildEvent() : BuildEvent(BuildResult::DONTKNOW) {
+	}
+
+	BuildEvent(BuildResult result, uint64_t job) :
+		result(result),
+		job(job) {
+	}
+
+	BuildResult result{BuildResult::DONTKNOW};
+	uint64_t job{0};      // fingerprint of the job name, 0 if unnamed
+	uint64_t sequence{0}; // set on admission, see pipeline::AdmissionQueue
+	bool statisticsChanged{false}; // see pipeline::JobTable::update
+};
+
+/**
+ * Statistics of one job over its recent builds.
+ */
+struct JobStatistics {
+	using Duration = std::chrono::steady_clock::duration;
+
+	size_t builds{0};
+	double failureRate{0}; // exponentially decayed share of failed builds
+	double flipRate{0};    // ... and of builds that changed the result
+	unsigned windowBuilds{0};   // of the last JobStatistics::WINDOW_LEN
+	unsigned windowFailures{0};
+	unsigned windowFlips{0};
+	Duration lastTimeToGreen{0};
+	Duration meanTimeToGreen{0}; // exponentially decayed
+	bool broken{false};
+	bool flaky{false};
+
+	static const unsigned WINDOW_LEN{64};
+};
+
+/**
+ * Query interface of per-job build statistics.
+ */
+class BuildStatistics {
+public:
+	virtual ~BuildStatistics() {}
+	virtual size_t getFlakyJobCount() const = 0;
+	virtual bool getJobStatistics(uint64_t job, JobStatistics& statistics) const = 0;
+};
+
 class Signalizer {
 public:
 	Signalizer(Beeper& beeper, RgbLight& rgbLight);
 	void update(BuildResult buildResult);
 
+	/**
+	 * With statistics, an OK result shows amber instead of green while any
+	 * job is flaky.
+	 */
+	void setStatistics(const BuildStatistics* statistics);
+
 private:
 	Beeper& beeper;
 	RgbLight& rgbLight;
+	const BuildStatistics* statistics{nullptr};
 };
 
 class BuildResultParser {
-	virtual BuildResult parseMsg(const std::string& msg) = 0;
+public:
+	virtual ~BuildResultParser() {}
+	virtual BuildResult parseMsg(StringView msg) = 0;
+
+	/**
+	 * Result and job of a message. Parsers that know the job name override
+	 * this; the default leaves the job unnamed.
+	 */
+	virtual BuildEvent parseEvent(StringView msg) {
+		return BuildEvent{parseMsg(msg)};
+	}
+};
+
+/**
+ * Fields of a Jenkins notification, as views into the message.
+ */
+struct JenkinsNotification {
+	StringView name;
+	StringView phase;
+	StringView status;
+	int64_t number{-1};
 };
 
+/**
+ * Understands the JSON and XML formats of the Jenkins notification plugin.
+ * The build status is classified by status rules (see rules::RuleEngine),
+ * which may be shared with other parsers and reloaded (see rules::RuleSet);
+ * messages in neither format are classified as a whole.
+ */
 class JenkinsBuildResultParser : public BuildResultParser {
 public:
-	BuildResult parseMsg(const std::string& msg) override;
+	/**
+	 * Default rules: SUCCESS is OK, FAILURE is BROKEN.
+	 */
+	JenkinsBuildResultParser();
+	JenkinsBuildResultParser(const std::vector<rules::Rule>& statusRules);
+	JenkinsBuildResultParser(std::shared_ptr<const rules::RuleSet> statusRules);
+
+	/**
+	 * Messages in neither format are classified by rawRules instead, for
+	 * status rules shared with other parsers whose generic words ("error")
+	 * would match arbitrary text.
+	 */
+	JenkinsBuildResultParser(std::shared_ptr<const rules::RuleSet> statusRules,
+			std::shared_ptr<const rules::RuleSet> rawRules);
+
+	BuildResult parseMsg(StringView msg) override;
+	BuildEvent parseEvent(StringView msg) override;
+
+	/**
+	 * Reads name, build.phase, build.status and build.number from a JSON
+	 * notification without copying, and stops as soon as all are found.
+	 * Returns false if msg is not a JSON object.
+	 */
+	static bool parseJson(StringView msg, JenkinsNotification& notification);
+
+private:
+	std::shared_ptr<const rules::RuleSet> statusRules;
+	std::shared_ptr<const rules::RuleSet> rawRules;
 };
 
 class KeyValueStore {
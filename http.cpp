@@ -0,0 +1,320 @@
+#include "http.h"
+
+namespace network {
+
+using common::StringView;
+
+const StringView HTTP_RESPONSE_OK{
+	"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"};
+const StringView HTTP_RESPONSE_OK_CLOSE{
+	"HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"};
+const StringView HTTP_RESPONSE_CONTINUE{
+	"HTTP/1.1 100 Continue\r\n\r\n"};
+const StringView HTTP_RESPONSE_BAD_REQUEST{
+	"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"};
+const StringView HTTP_RESPONSE_TOO_LARGE{
+	"HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"};
+
+const size_t HttpRequestParser::LINE_LEN_MAX;
+
+namespace {
+
+char toLower(char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+bool equalsIgnoreCase(StringView lhs, StringView rhs) {
+	if (lhs.size() != rhs.size())
+		return false;
+	for (size_t i = 0; i < lhs.size(); i++) {
+		if (toLower(lhs[i]) != toLower(rhs[i]))
+			return false;
+	}
+	return true;
+}
+
+bool isSpace(char c) {
+	return c == ' ' || c == '\t';
+}
+
+StringView trim(StringView str) {
+	size_t begin = 0;
+	size_t end = str.size();
+	while (begin < end && isSpace(str[begin]))
+		begin++;
+	while (end > begin && isSpace(str[end - 1]))
+		end--;
+	return str.substr(begin, end - begin);
+}
+
+/**
+ * Checks a comma separated header value for a token, e.g. "close" in
+ * "Connection: TE, close".
+ */
+bool hasToken(StringView value, StringView token) {
+	while (!value.empty()) {
+		size_t comma = value.find(',');
+		if (equalsIgnoreCase(trim(value.substr(0, comma)), token))
+			return true;
+		if (comma == StringView::npos)
+			break;
+		value = value.substr(comma + 1);
+	}
+	return false;
+}
+
+bool lastTokenIs(StringView value, StringView token) {
+	size_t comma = StringView::npos;
+	for (size_t i = value.size(); i > 0; i--) {
+		if (value[i - 1] == ',') {
+			comma = i - 1;
+			break;
+		}
+	}
+	auto last = (comma == StringView::npos) ? value : value.substr(comma + 1);
+	return equalsIgnoreCase(trim(last), token);
+}
+
+const StringView METHODS[] = {
+	"POST ", "PUT ", "GET ", "HEAD ", "DELETE ", "OPTIONS ", "PATCH "
+};
+
+} // namespace
+
+bool HttpRequestParser::isRequestStart(StringView data) {
+	for (auto method : METHODS) {
+		if (data.startsWith(method))
+			return true;
+	}
+	return false;
+}
+
+HttpRequestParser::Result HttpRequestParser::parse(const char*& data,
+		const char* end, StringView& body) {
+	while (1) {
+		switch (state) {
+		case State::REQUEST_LINE:
+			if (!readLine(data, end))
+				return Result::INCOMPLETE;
+			// Empty lines in front of a request are to be ignored.
+			if (lineLen == 0)
+				break;
+			if (!parseRequestLine()) {
+				state = State::FAILED;
+				return Result::ERROR;
+			}
+			state = State::HEADER_LINE;
+			break;
+
+		case State::HEADER_LINE:
+			if (!readLine(data, end))
+				return Result::INCOMPLETE;
+			if (lineLen == 0) {
+				if (chunked) {
+					state = State::CHUNK_SIZE_LINE;
+				} else {
+					remaining = contentLength;
+					state = State::BODY;
+				}
+				return Result::HEADERS_COMPLETE;
+			}
+			if (!parseHeaderLine()) {
+				state = State::FAILED;
+				return Result::ERROR;
+			}
+			break;
+
+		case State::BODY:
+			if (remaining == 0) {
+				state = State::DONE;
+				break;
+			}
+			return bodyPiece(data, end, body);
+
+		case State::CHUNK_SIZE_LINE:
+			if (!readLine(data, end))
+				return Result::INCOMPLETE;
+			if (!parseChunkSizeLine()) {
+				state = State::FAILED;
+				return Result::ERROR;
+			}
+			state = remaining ? State::CHUNK_DATA : State::TRAILER_LINE;
+			break;
+
+		case State::CHUNK_DATA:
+			if (remaining == 0) {
+				state = State::CHUNK_DATA_END;
+				break;
+			}
+			return bodyPiece(data, end, body);
+
+		case State::CHUNK_DATA_END:
+			if (!readLine(data, end))
+				return Result::INCOMPLETE;
+			if (lineLen != 0) {
+				state = State::FAILED;
+				return Result::ERROR;
+			}
+			state = State::CHUNK_SIZE_LINE;
+			break;
+
+		case State::TRAILER_LINE:
+			if (!readLine(data, end))
+				return Result::INCOMPLETE;
+			if (lineLen == 0)
+				state = State::DONE;
+			break;
+
+		case State::DONE:
+			return Result::COMPLETE;
+
+		case State::FAILED:
+			return Result::ERROR;
+		}
+	}
+}
+
+void HttpRequestParser::reset() {
+	state = State::REQUEST_LINE;
+	lineLen = 0;
+	lineComplete = false;
+	lineTruncated = false;
+	keepAlive = true;
+	expectContinue = false;
+	chunked = false;
+	contentLength = 0;
+	remaining = 0;
+}
+
+bool HttpRequestParser::readLine(const char*& data, const char* end) {
+	if (lineComplete) {
+		lineLen = 0;
+		lineComplete = false;
+		lineTruncated = false;
+	}
+
+	auto newline = static_cast<const char*>(memchr(data, '\n', end - data));
+	const char* lineEnd = newline ? newline : end;
+
+	size_t count = lineEnd - data;
+	if (count > LINE_LEN_MAX - lineLen) {
+		count = LINE_LEN_MAX - lineLen;
+		lineTruncated = true;
+	}
+	memcpy(line + lineLen, data, count);
+	lineLen += count;
+
+	if (!newline) {
+		data = end;
+		return false;
+	}
+
+	data = newline + 1;
+	if (lineLen > 0 && line[lineLen - 1] == '\r' && !lineTruncated)
+		lineLen--;
+	lineComplete = true;
+	return true;
+}
+
+bool HttpRequestParser::parseRequestLine() {
+	StringView requestLine{line, lineLen};
+	size_t firstSpace = requestLine.find(' ');
+	if (firstSpace == 0 || firstSpace == StringView::npos)
+		return false;
+
+	// The version cannot be evaluated if a long target got truncated.
+	if (lineTruncated)
+		return true;
+
+	size_t lastSpace = lineLen;
+	while (lastSpace > 0 && line[lastSpace - 1] != ' ')
+		lastSpace--;
+	if (lastSpace <= firstSpace + 1)
+		return false;
+
+	auto version = requestLine.substr(lastSpace);
+	if (version == "HTTP/1.1")
+		keepAlive = true;
+	else if (version == "HTTP/1.0")
+		keepAlive = false;
+	else
+		return false;
+	return true;
+}
+
+bool HttpRequestParser::parseHeaderLine() {
+	StringView headerLine{line, lineLen};
+	size_t colon = headerLine.find(':');
+	if (colon == 0 || colon == StringView::npos)
+		return false;
+
+	auto name = headerLine.substr(0, colon);
+	auto value = trim(headerLine.substr(colon + 1));
+
+	if (equalsIgnoreCase(name, "Content-Length")) {
+		if (value.empty() || lineTruncated)
+			return false;
+		uint64_t length = 0;
+		for (char c : value) {
+			if (c < '0' || c > '9' || length > (UINT64_MAX - 9) / 10)
+				return false;
+			length = length * 10 + (c - '0');
+		}
+		contentLength = length;
+	} else if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+		// Other codings cannot be delimited unless chunked is applied last.
+		if (!lastTokenIs(value, "chunked"))
+			return false;
+		chunked = true;
+	} else if (equalsIgnoreCase(name, "Connection")) {
+		if (hasToken(value, "close"))
+			keepAlive = false;
+		else if (hasToken(value, "keep-alive"))
+			keepAlive = true;
+	} else if (equalsIgnoreCase(name, "Expect")) {
+		if (equalsIgnoreCase(value, "100-continue"))
+			expectContinue = true;
+	}
+	return true;
+}
+
+bool HttpRequestParser::parseChunkSizeLine() {
+	uint64_t size = 0;
+	size_t digits = 0;
+	for (size_t i = 0; i < lineLen; i++) {
+		char c = toLower(line[i]);
+		uint64_t digit;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c == ';' || isSpace(c))
+			break; // chunk extensions are ignored
+		else
+			return false;
+
+		if (++digits > 15)
+			return false;
+		size = (size << 4) | digit;
+	}
+	if (digits == 0)
+		return false;
+
+	remaining = size;
+	return true;
+}
+
+HttpRequestParser::Result HttpRequestParser::bodyPiece(const char*& data,
+		const char* end, StringView& body) {
+	size_t available = end - data;
+	if (available == 0)
+		return Result::INCOMPLETE;
+
+	size_t count = (remaining < available) ? remaining : available;
+	body = StringView(data, count);
+	data += count;
+	remaining -= count;
+	return Result::BODY;
+}
+
+} // namespace network
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "common.h"
+
+namespace network {
+
+/**
+ * Incremental, allocation-free HTTP/1.1 request parser. Bytes can be fed in
+ * arbitrarily sized pieces; body bytes are returned as views into the input
+ * without being copied. Supports Content-Length and chunked bodies as well as
+ * persistent connections (including pipelined requests).
+ */
+class HttpRequestParser {
+public:
+	enum class Result {
+		INCOMPLETE,       // all input consumed, request not yet complete
+		HEADERS_COMPLETE, // end of header section reached
+		BODY,             // body holds the next piece of the body
+		COMPLETE,         // request complete, call reset() for the next one
+		ERROR             // malformed request, connection should be closed
+	};
+
+	/**
+	 * Advances data up to end; returns as soon as there is something to
+	 * report to the caller.
+	 */
+	Result parse(const char*& data, const char* end, common::StringView& body);
+	void reset();
+
+	bool isKeepAlive() const { return keepAlive; }
+	bool expectsContinue() const { return expectContinue; }
+	bool isChunked() const { return chunked; }
+	uint64_t getContentLength() const { return contentLength; }
+
+	/**
+	 * Lines longer than this are truncated, which only matters for request
+	 * lines and header values that are evaluated here.
+	 */
+	static const size_t LINE_LEN_MAX{512};
+
+	static bool isRequestStart(common::StringView data);
+
+private:
+	enum class State {
+		REQUEST_LINE,
+		HEADER_LINE,
+		BODY,
+		CHUNK_SIZE_LINE,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		TRAILER_LINE,
+		DONE,
+		FAILED
+	};
+
+	bool readLine(const char*& data, const char* end);
+	bool parseRequestLine();
+	bool parseHeaderLine();
+	bool parseChunkSizeLine();
+	Result bodyPiece(const char*& data, const char* end, common::StringView& body);
+
+private:
+	State state{State::REQUEST_LINE};
+	char line[LINE_LEN_MAX];
+	size_t lineLen{0};
+	bool lineComplete{false};
+	bool lineTruncated{false};
+	bool keepAlive{true};
+	bool expectContinue{false};
+	bool chunked{false};
+	uint64_t contentLength{0};
+	uint64_t remaining{0};
+};
+
+extern const common::StringView HTTP_RESPONSE_OK;
+extern const common::StringView HTTP_RESPONSE_OK_CLOSE;
+extern const common::StringView HTTP_RESPONSE_CONTINUE;
+extern const common::StringView HTTP_RESPONSE_BAD_REQUEST;
+extern const common::StringView HTTP_RESPONSE_TOO_LARGE;
+
+} // namespace network
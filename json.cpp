@@ -0,0 +1,223 @@
+#include "json.h"
+
+namespace json {
+
+using common::StringView;
+
+JsonReader::JsonReader(StringView input) :
+	pos(input.data()),
+	end(input.data() + input.size()) {
+}
+
+JsonReader::Token JsonReader::next() {
+	skipWhitespace();
+	while (pos != end && (*pos == ',' || *pos == ':')) {
+		pos++;
+		skipWhitespace();
+	}
+	if (pos == end)
+		return Token::END;
+
+	const char* start = pos;
+	switch (*pos) {
+	case '{':
+		pos++;
+		depth++;
+		return Token::BEGIN_OBJECT;
+	case '[':
+		pos++;
+		depth++;
+		return Token::BEGIN_ARRAY;
+	case '}':
+		pos++;
+		depth--;
+		return Token::END_OBJECT;
+	case ']':
+		pos++;
+		depth--;
+		return Token::END_ARRAY;
+	case '"':
+		if (!readString())
+			return Token::ERROR;
+		return isKeyNext() ? Token::KEY : Token::STRING;
+	}
+
+	while (pos != end && *pos != ',' && *pos != '}' && *pos != ']' &&
+			*pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '\n')
+		pos++;
+	value = StringView{start, (size_t)(pos - start)};
+
+	char first = *start;
+	if (first == '-' || (first >= '0' && first <= '9'))
+		return Token::NUMBER;
+	if (value == "true" || value == "false" || value == "null")
+		return Token::LITERAL;
+	return Token::ERROR;
+}
+
+StringView JsonReader::getValue() const {
+	return value;
+}
+
+int JsonReader::getDepth() const {
+	return depth;
+}
+
+bool JsonReader::skipValue() {
+	skipWhitespace();
+	if (pos == end)
+		return false;
+	if (*pos == '"')
+		return skipString();
+	if (*pos != '{' && *pos != '[') {
+		Token token = next();
+		return token == Token::NUMBER || token == Token::LITERAL;
+	}
+
+	// Containers: only quotes and brackets matter, the bulk of the bytes
+	// are usually inside strings which skipString() passes with memchr().
+	int nested = 0;
+	while (pos != end) {
+		char c = *pos;
+		if (c == '"') {
+			if (!skipString())
+				return false;
+			continue;
+		}
+		pos++;
+		if (c == '{' || c == '[') {
+			nested++;
+		} else if (c == '}' || c == ']') {
+			if (--nested == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+bool JsonReader::toInt(StringView number, int64_t& value) {
+	size_t i = 0;
+	bool negative = number.size() > 0 && number[0] == '-';
+	if (negative)
+		i++;
+	if (i == number.size())
+		return false;
+
+	int64_t result = 0;
+	for (; i < number.size(); i++) {
+		char c = number[i];
+		if (c < '0' || c > '9' || result > (INT64_MAX - 9) / 10)
+			return false;
+		result = result * 10 + (c - '0');
+	}
+	value = negative ? -result : result;
+	return true;
+}
+
+void JsonReader::skipWhitespace() {
+	while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\r' ||
+				*pos == '\n'))
+		pos++;
+}
+
+bool JsonReader::skipString() {
+	pos++; // opening quote
+	while (pos != end) {
+		const char* quote = static_cast<const char*>(
+				memchr(pos, '"', end - pos));
+		if (!quote)
+			break;
+
+		// The quote is escaped if preceded by an odd number of backslashes.
+		const char* p = quote;
+		while (p != pos && p[-1] == '\\')
+			p--;
+		pos = quote + 1;
+		if ((quote - p) % 2 == 0)
+			return true;
+	}
+	pos = end;
+	return false;
+}
+
+bool JsonReader::readString() {
+	const char* start = pos + 1;
+	if (!skipString())
+		return false;
+	value = StringView{start, (size_t)(pos - 1 - start)};
+	return true;
+}
+
+bool JsonReader::isKeyNext() {
+	skipWhitespace();
+	if (pos != end && *pos == ':') {
+		pos++;
+		return true;
+	}
+	return false;
+}
+
+bool extractFields(StringView msg, const FieldPath* fields, size_t count,
+		StringView* values) {
+	JsonReader reader{msg};
+	if (count > 32 || reader.next() != JsonReader::Token::BEGIN_OBJECT)
+		return false;
+
+	auto isParent = [&](StringView key) {
+		for (size_t i = 0; i < count; i++) {
+			if (!fields[i].parent.empty() && fields[i].parent == key)
+				return true;
+		}
+		return false;
+	};
+
+	uint32_t found = 0;
+	size_t missing = count;
+	StringView parent;
+	while (missing) {
+		JsonReader::Token token = reader.next();
+		if (token == JsonReader::Token::END || token == JsonReader::Token::ERROR)
+			break;
+		if (token == JsonReader::Token::END_OBJECT && reader.getDepth() <= 1) {
+			if (reader.getDepth() == 0)
+				break;
+			parent = StringView{};
+		}
+		if (token != JsonReader::Token::KEY)
+			continue;
+
+		StringView key = reader.getValue();
+		int depth = reader.getDepth();
+		size_t field = count;
+		for (size_t i = 0; i < count && field == count; i++) {
+			if ((found & (1u << i)) || fields[i].key != key)
+				continue;
+			if ((depth == 1 && fields[i].parent.empty()) ||
+					(depth == 2 && !parent.empty() && fields[i].parent == parent))
+				field = i;
+		}
+
+		if (field == count) {
+			if (depth == 1 && isParent(key)) {
+				if (reader.next() != JsonReader::Token::BEGIN_OBJECT)
+					break;
+				parent = key;
+			} else if (!reader.skipValue()) {
+				break;
+			}
+			continue;
+		}
+
+		token = reader.next();
+		if (token != JsonReader::Token::STRING &&
+				token != JsonReader::Token::NUMBER &&
+				token != JsonReader::Token::LITERAL)
+			break;
+		values[field] = reader.getValue();
+		found |= 1u << field;
+		missing--;
+	}
+	return true;
+}
+
+} // namespace json
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "common.h"
+
+namespace json {
+
+/**
+ * Allocation-free pull reader for JSON text. Tokens are returned as views
+ * into the input: string and key values are raw, i.e. escape sequences are
+ * left as they are. The reader is tolerant rather than validating; it only
+ * reports ERROR where it cannot find its way.
+ */
+class JsonReader {
+public:
+	enum class Token {
+		BEGIN_OBJECT,
+		END_OBJECT,
+		BEGIN_ARRAY,
+		END_ARRAY,
+		KEY,     // a string followed by ':'
+		STRING,
+		NUMBER,
+		LITERAL, // true, false or null
+		END,
+		ERROR
+	};
+
+	JsonReader(common::StringView input);
+
+	Token next();
+
+	/**
+	 * Text of the last KEY, STRING, NUMBER or LITERAL token.
+	 */
+	common::StringView getValue() const;
+
+	/**
+	 * Nesting depth after the last token; 1 inside the top-level object.
+	 */
+	int getDepth() const;
+
+	/**
+	 * Skips the value after a KEY, including nested objects and arrays,
+	 * without tokenizing its contents.
+	 */
+	bool skipValue();
+
+	static bool toInt(common::StringView number, int64_t& value);
+
+private:
+	void skipWhitespace();
+	bool skipString();
+	bool readString();
+	bool isKeyNext();
+
+	const char* pos;
+	const char* end;
+	common::StringView value;
+	int depth{0};
+};
+
+/**
+ * A field of the top-level object (parent empty) or of an object nested
+ * directly in it.
+ */
+struct FieldPath {
+	common::StringView parent;
+	common::StringView key;
+};
+
+/**
+ * Stores the text of the first string, number or literal value found for
+ * each of the count fields in values; fields not found are left untouched.
+ * Scanning stops as soon as all fields are found, other values are skipped
+ * without being tokenized. Returns false if msg is not a JSON object (or
+ * more than 32 fields are asked for).
+ */
+bool extractFields(common::StringView msg, const FieldPath* fields,
+		size_t count, common::StringView* values);
+
+} // namespace json
@@ -2,6 +2,238 @@
 
 namespace network {
 
+const size_t BufferPool::CHUNK_SIZE;
+const size_t StreamServer::MESSAGE_LEN_MAX;
+const size_t DatagramReceiver::BATCH_LEN;
+const size_t DatagramReceiver::DATAGRAM_LEN_MAX;
+
+BufferPool::BufferPool(size_t chunksRetainedMax) :
+	chunksRetainedMax(chunksRetainedMax) {
+}
+
+BufferPool::~BufferPool() {
+	for (auto chunk : freeChunks)
+		delete chunk;
+}
+
+BufferPool::Chunk* BufferPool::acquire() {
+	if (freeChunks.empty()) {
+		allocatedCount++;
+		return new Chunk;
+	}
+
+	reusedCount++;
+	Chunk* chunk = freeChunks.back();
+	freeChunks.pop_back();
+	chunk->size = 0;
+	return chunk;
+}
+
+void BufferPool::release(Chunk* chunk) {
+	if (freeChunks.size() < chunksRetainedMax)
+		freeChunks.push_back(chunk);
+	else
+		delete chunk;
+}
+
+size_t BufferPool::getAllocatedCount() {
+	return allocatedCount;
+}
+
+size_t BufferPool::getReusedCount() {
+	return reusedCount;
+}
+
+MessageAssembler::MessageAssembler(BufferPool& pool, Framing framing, char delimiter) :
+	pool(&pool),
+	framing(framing),
+	delimiter(delimiter) {
+}
+
+MessageAssembler::~MessageAssembler() {
+	clear();
+}
+
+MessageAssembler::MessageAssembler(MessageAssembler&& other) :
+	pool(other.pool),
+	framing(other.framing),
+	delimiter(other.delimiter),
+	chunks(std::move(other.chunks)),
+	headOffset(other.headOffset),
+	totalSize(other.totalSize),
+	scanned(other.scanned),
+	scratch(std::move(other.scratch)) {
+
+	other.chunks.clear();
+	other.headOffset = 0;
+	other.totalSize = 0;
+	other.scanned = 0;
+}
+
+MessageAssembler& MessageAssembler::operator=(MessageAssembler&& other) {
+	if (this != &other) {
+		clear();
+		pool = other.pool;
+		framing = other.framing;
+		delimiter = other.delimiter;
+		chunks = std::move(other.chunks);
+		headOffset = other.headOffset;
+		totalSize = other.totalSize;
+		scanned = other.scanned;
+		scratch = std::move(other.scratch);
+
+		other.chunks.clear();
+		other.headOffset = 0;
+		other.totalSize = 0;
+		other.scanned = 0;
+	}
+	return *this;
+}
+
+char* MessageAssembler::writePtr() {
+	if (chunks.empty() || chunks.back()->size == BufferPool::CHUNK_SIZE)
+		chunks.push_back(pool->acquire());
+	return chunks.back()->data + chunks.back()->size;
+}
+
+size_t MessageAssembler::writeSpace() {
+	// A full tail chunk is replaced by a fresh one in writePtr().
+	if (chunks.empty() || chunks.back()->size == BufferPool::CHUNK_SIZE)
+		return BufferPool::CHUNK_SIZE;
+	return BufferPool::CHUNK_SIZE - chunks.back()->size;
+}
+
+void MessageAssembler::commit(size_t count) {
+	chunks.back()->size += count;
+	totalSize += count;
+}
+
+void MessageAssembler::append(const char* data, size_t count) {
+	while (count > 0) {
+		char* dest = writePtr();
+		size_t n = std::min(count, writeSpace());
+		memcpy(dest, data, n);
+		commit(n);
+		data += n;
+		count -= n;
+	}
+}
+
+void MessageAssembler::extract(const MessageHandler& handler) {
+	if (framing == Framing::DELIMITED) {
+		size_t pos;
+		while ((pos = find(delimiter, scanned)) != common::StringView::npos) {
+			handler(view(0, pos));
+			consume(pos + 1);
+		}
+		scanned = totalSize;
+	} else if (framing == Framing::LENGTH_PREFIXED) {
+		const size_t PREFIX_LEN{4};
+		while (totalSize >= PREFIX_LEN) {
+			size_t len = ((size_t)byteAt(0) << 24) | ((size_t)byteAt(1) << 16) |
+				((size_t)byteAt(2) << 8) | byteAt(3);
+			if (totalSize < PREFIX_LEN + len)
+				break;
+			handler(view(PREFIX_LEN, len));
+			consume(PREFIX_LEN + len);
+		}
+	}
+}
+
+void MessageAssembler::finish(const MessageHandler& handler) {
+	extract(handler);
+	if (framing != Framing::LENGTH_PREFIXED && totalSize > 0)
+		handler(view(0, totalSize));
+	clear();
+}
+
+common::StringView MessageAssembler::contents() {
+	return view(0, totalSize);
+}
+
+size_t MessageAssembler::size() {
+	return totalSize;
+}
+
+void MessageAssembler::clear() {
+	for (auto chunk : chunks)
+		pool->release(chunk);
+	chunks.clear();
+	headOffset = 0;
+	totalSize = 0;
+	scanned = 0;
+}
+
+common::StringView MessageAssembler::view(size_t offset, size_t count) {
+	if (count == 0)
+		return common::StringView();
+
+	// Locate the chunk holding the first byte.
+	size_t chunkIdx = 0;
+	size_t pos = headOffset + offset;
+	while (pos >= chunks[chunkIdx]->size) {
+		pos -= chunks[chunkIdx]->size;
+		chunkIdx++;
+	}
+
+	if (pos + count <= chunks[chunkIdx]->size)
+		return common::StringView(chunks[chunkIdx]->data + pos, count);
+
+	scratch.resize(count);
+	size_t copied = 0;
+	while (copied < count) {
+		size_t n = std::min(count - copied, chunks[chunkIdx]->size - pos);
+		memcpy(scratch.data() + copied, chunks[chunkIdx]->data + pos, n);
+		copied += n;
+		pos = 0;
+		chunkIdx++;
+	}
+	return common::StringView(scratch.data(), count);
+}
+
+size_t MessageAssembler::find(char c, size_t from) {
+	size_t base = 0;
+	size_t begin = headOffset;
+	for (auto chunk : chunks) {
+		size_t avail = chunk->size - begin;
+		if (from < base + avail) {
+			size_t start = begin + (from > base ? from - base : 0);
+			auto found = static_cast<const char*>(
+					memchr(chunk->data + start, c, chunk->size - start));
+			if (found)
+				return base + (found - (chunk->data + begin));
+		}
+		base += avail;
+		begin = 0;
+	}
+	return common::StringView::npos;
+}
+
+uint8_t MessageAssembler::byteAt(size_t pos) {
+	pos += headOffset;
+	for (auto chunk : chunks) {
+		if (pos < chunk->size)
+			return chunk->data[pos];
+		pos -= chunk->size;
+	}
+	return 0;
+}
+
+void MessageAssembler::consume(size_t count) {
+	totalSize -= count;
+	scanned = 0;
+	count += headOffset;
+
+	size_t released = 0;
+	while (released < chunks.size() && count >= chunks[released]->size) {
+		count -= chunks[released]->size;
+		pool->release(chunks[released]);
+		released++;
+	}
+	chunks.erase(chunks.begin(), chunks.begin() + released);
+	headOffset = count;
+}
+
 TcpServer::TcpServer(uint16_t port) {
 	if ((createSocket = socket (AF_INET, SOCK_STREAM, 0)) == -1)
 		throw std::runtime_error("cannot create socket.");
@@ -24,16 +256,456 @@ std::string TcpServer::receiveClientMsg() {
 	socklen_t addrlen{sizeof(struct sockaddr_in)};
 	int rxSocket = accept(createSocket, (struct sockaddr*)&listenAddress,
 			&addrlen);
+	syscallCount++;
 	if (rxSocket <= 0)
 		throw std::runtime_error("error on accept()");
 
-	ssize_t size = recv(rxSocket, rxBuffer, RECEIVE_BUF_LEN-1, 0);
-	if (size > 0)
-		rxBuffer[size] = '\0';
+	while (assembler.size() < StreamServer::MESSAGE_LEN_MAX) {
+		char* dest = assembler.writePtr();
+		ssize_t size = recv(rxSocket, dest, assembler.writeSpace(), 0);
+		syscallCount++;
+		if (size > 0)
+			assembler.commit(size);
+		else if (size == 0 || errno != EINTR)
+			break;
+	}
+
+	if (assembler.size() >= StreamServer::MESSAGE_LEN_MAX)
+		printf("ERROR: message truncated to %zu bytes.\n",
+				StreamServer::MESSAGE_LEN_MAX);
 
 	close(rxSocket);
-	std::string out(rxBuffer);
+	syscallCount++;
+	std::string out;
+	assembler.finish([&out](common::StringView msg) {
+		out = msg.toString();
+	});
 	return out;
 }
 
+size_t TcpServer::getSyscallCount() {
+	return syscallCount;
+}
+
+void StreamServer::run() {
+	while (1)
+		poll(-1);
+}
+
+StreamConnection::StreamConnection(BufferPool& pool, Framing framing) :
+	framing(framing),
+	assembler(pool, framing),
+	body(pool, Framing::UNTIL_EOF) {
+}
+
+void StreamConnection::open(int fd) {
+	this->fd = fd;
+	protocol = (framing == Framing::HTTP) ? Protocol::UNDECIDED : Protocol::RAW;
+	httpParser.reset();
+}
+
+void StreamConnection::close() {
+	fd = -1;
+	assembler.clear();
+	body.clear();
+}
+
+bool StreamConnection::isOpen() const {
+	return fd != -1;
+}
+
+char* StreamConnection::writePtr() {
+	return assembler.writePtr();
+}
+
+size_t StreamConnection::writeSpace() {
+	return assembler.writeSpace();
+}
+
+bool StreamConnection::commit(size_t count, const MessageHandler& handler) {
+	assembler.commit(count);
+	return process(handler);
+}
+
+bool StreamConnection::append(const char* data, size_t count,
+		const MessageHandler& handler) {
+	if (protocol == Protocol::HTTP)
+		return parseHttp(data, count, handler);
+	assembler.append(data, count);
+	return process(handler);
+}
+
+void StreamConnection::finish(const MessageHandler& handler) {
+	if (protocol != Protocol::HTTP)
+		assembler.finish(handler);
+}
+
+bool StreamConnection::process(const MessageHandler& handler) {
+	if (protocol == Protocol::UNDECIDED) {
+		// Long enough for the longest request method ("OPTIONS ").
+		const size_t DETECTION_LEN{8};
+		if (assembler.size() < DETECTION_LEN)
+			return true;
+		auto start = assembler.contents().substr(0, DETECTION_LEN);
+		protocol = HttpRequestParser::isRequestStart(start) ?
+			Protocol::HTTP : Protocol::RAW;
+	}
+
+	if (protocol == Protocol::HTTP) {
+		// The request is parsed where it was received; the chunk is reused
+		// by the next receive.
+		auto received = assembler.contents();
+		bool open = parseHttp(received.data(), received.size(), handler);
+		assembler.clear();
+		return open;
+	}
+
+	assembler.extract(handler);
+	if (assembler.size() > StreamServer::MESSAGE_LEN_MAX) {
+		printf("ERROR: dropping message longer than %zu bytes.\n",
+				StreamServer::MESSAGE_LEN_MAX);
+		return false;
+	}
+	return true;
+}
+
+bool StreamConnection::parseHttp(const char* data, size_t size,
+		const MessageHandler& handler) {
+	const char* end = data + size;
+
+	while (1) {
+		common::StringView piece;
+		switch (httpParser.parse(data, end, piece)) {
+		case HttpRequestParser::Result::INCOMPLETE:
+			return true;
+
+		case HttpRequestParser::Result::HEADERS_COMPLETE:
+			if (httpParser.expectsContinue())
+				sendResponse(HTTP_RESPONSE_CONTINUE);
+			break;
+
+		case HttpRequestParser::Result::BODY:
+			if (body.size() + piece.size() > StreamServer::MESSAGE_LEN_MAX) {
+				printf("ERROR: dropping request body longer than %zu bytes.\n",
+						StreamServer::MESSAGE_LEN_MAX);
+				sendResponse(HTTP_RESPONSE_TOO_LARGE);
+				return false;
+			}
+			body.append(piece.data(), piece.size());
+			break;
+
+		case HttpRequestParser::Result::COMPLETE:
+			body.finish(handler);
+			if (!httpParser.isKeepAlive()) {
+				sendResponse(HTTP_RESPONSE_OK_CLOSE);
+				return false;
+			}
+			sendResponse(HTTP_RESPONSE_OK);
+			httpParser.reset();
+			break;
+
+		case HttpRequestParser::Result::ERROR:
+			sendResponse(HTTP_RESPONSE_BAD_REQUEST);
+			return false;
+		}
+	}
+}
+
+void StreamConnection::sendResponse(common::StringView response) {
+	// Responses are tiny and fit into an empty socket buffer; a client that
+	// does not read them only hurts itself.
+	send(fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+
+EpollTcpServer::EpollTcpServer(uint16_t port, MessageHandler handler,
+		Framing framing, bool reusePort) :
+	handler(handler),
+	framing(framing) {
+
+	listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenSocket == -1)
+		throw std::runtime_error("cannot create socket.");
+
+	const int optVal{1};
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+	if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT,
+				&optVal, sizeof(int)) != 0) {
+		close(listenSocket);
+		throw std::runtime_error("cannot set SO_REUSEPORT.");
+	}
+
+	struct sockaddr_in listenAddress;
+	memset(&listenAddress, 0, sizeof(listenAddress));
+	listenAddress.sin_family = AF_INET;
+	listenAddress.sin_addr.s_addr = INADDR_ANY;
+	listenAddress.sin_port = htons(port);
+	if (bind(listenSocket, (struct sockaddr *) &listenAddress,
+				sizeof (listenAddress)) != 0) {
+		close(listenSocket);
+		throw std::runtime_error("bind error: cannot listen on port.");
+	}
+
+	if (listen(listenSocket, SOMAXCONN) != 0) {
+		close(listenSocket);
+		throw std::runtime_error("listen error.");
+	}
+
+	if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		close(listenSocket);
+		throw std::runtime_error("cannot create epoll instance.");
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = listenSocket;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &event) != 0) {
+		close(epollFd);
+		close(listenSocket);
+		throw std::runtime_error("cannot watch listen socket.");
+	}
+}
+
+EpollTcpServer::~EpollTcpServer() {
+	for (size_t fd = 0; fd < connections.size(); fd++) {
+		if (connections[fd].isOpen())
+			close(fd);
+	}
+	close(epollFd);
+	close(listenSocket);
+}
+
+void EpollTcpServer::poll(int timeoutMs) {
+	int count = epoll_wait(epollFd, events, EVENTS_MAX, timeoutMs);
+	if (count == -1) {
+		if (errno == EINTR)
+			return;
+		throw std::runtime_error("error on epoll_wait()");
+	}
+
+	for (int i = 0; i < count; i++) {
+		int fd = events[i].data.fd;
+		if (fd == listenSocket) {
+			acceptConnections();
+			continue;
+		}
+
+		auto w = std::find_if(watched.begin(), watched.end(),
+				[fd](const std::pair<int, ReadableHandler>& entry) {
+			return entry.first == fd;
+		});
+		if (w != watched.end())
+			w->second();
+		else
+			receiveFrom(fd);
+	}
+}
+
+void EpollTcpServer::watch(int fd, ReadableHandler readableHandler) {
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+		throw std::runtime_error("cannot watch file descriptor.");
+	watched.push_back(std::make_pair(fd, readableHandler));
+}
+
+uint16_t EpollTcpServer::getPort() {
+	struct sockaddr_in address;
+	socklen_t addrlen{sizeof(address)};
+	if (getsockname(listenSocket, (struct sockaddr*)&address, &addrlen) != 0)
+		throw std::runtime_error("error on getsockname()");
+	return ntohs(address.sin_port);
+}
+
+size_t EpollTcpServer::getOpenConnections() {
+	return openConnections;
+}
+
+void EpollTcpServer::acceptConnections() {
+	// Edge-triggered: drain the accept queue completely.
+	while (1) {
+		int fd = accept4(listenSocket, nullptr, nullptr,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				printf("ERROR on accept(): %s.\n", strerror(errno));
+			return;
+		}
+
+		while ((size_t)fd >= connections.size())
+			connections.emplace_back(pool, framing);
+
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			close(fd);
+			continue;
+		}
+
+		connections[fd].open(fd);
+		openConnections++;
+	}
+}
+
+void EpollTcpServer::receiveFrom(int fd) {
+	StreamConnection& connection = connections[fd];
+
+	// Edge-triggered: read until the socket would block or the peer is done.
+	while (1) {
+		ssize_t size = recv(fd, connection.writePtr(), connection.writeSpace(), 0);
+		if (size > 0) {
+			if (!connection.commit(size, handler)) {
+				closeConnection(fd);
+				return;
+			}
+		} else if (size == 0) {
+			connection.finish(handler);
+			closeConnection(fd);
+			return;
+		} else {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				closeConnection(fd);
+			return;
+		}
+	}
+}
+
+void EpollTcpServer::closeConnection(int fd) {
+	connections[fd].close();
+	openConnections--;
+	close(fd);
+}
+
+DatagramReceiver::DatagramReceiver(uint16_t port, MessageHandler handler) :
+	handler(handler) {
+
+	socketFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socketFd == -1)
+		throw std::runtime_error("cannot create socket.");
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(port);
+	if (bind(socketFd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		close(socketFd);
+		throw std::runtime_error("bind error: cannot listen on port.");
+	}
+
+	setupBatch();
+}
+
+DatagramReceiver::DatagramReceiver(const std::string& socketPath, MessageHandler handler) :
+	handler(handler),
+	socketPath(socketPath) {
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path))
+		throw std::runtime_error("socket path too long.");
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.size());
+
+	socketFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socketFd == -1)
+		throw std::runtime_error("cannot create socket.");
+
+	unlink(socketPath.c_str());
+	if (bind(socketFd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		close(socketFd);
+		throw std::runtime_error("bind error: cannot bind unix socket.");
+	}
+
+	setupBatch();
+}
+
+DatagramReceiver::~DatagramReceiver() {
+	close(socketFd);
+	if (!socketPath.empty())
+		unlink(socketPath.c_str());
+}
+
+void DatagramReceiver::setupBatch() {
+	buffers.resize(BATCH_LEN * DATAGRAM_LEN_MAX);
+	memset(headers, 0, sizeof(headers));
+	for (size_t i = 0; i < BATCH_LEN; i++) {
+		iovecs[i].iov_base = buffers.data() + i * DATAGRAM_LEN_MAX;
+		iovecs[i].iov_len = DATAGRAM_LEN_MAX;
+		headers[i].msg_hdr.msg_iov = &iovecs[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+size_t DatagramReceiver::receive() {
+	size_t received = 0;
+	while (1) {
+		int count = recvmmsg(socketFd, headers, BATCH_LEN, MSG_DONTWAIT, nullptr);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				printf("ERROR on recvmmsg(): %s.\n", strerror(errno));
+			return received;
+		}
+		batchCount++;
+
+		for (int i = 0; i < count; i++) {
+			if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				printf("ERROR: dropping datagram longer than %zu bytes.\n",
+						DATAGRAM_LEN_MAX);
+				truncatedCount++;
+				continue;
+			}
+			handler(common::StringView(static_cast<const char*>(iovecs[i].iov_base),
+						headers[i].msg_len));
+			received++;
+			messageCount++;
+		}
+
+		// A short batch means the socket has been drained.
+		if ((size_t)count < BATCH_LEN)
+			return received;
+	}
+}
+
+size_t DatagramReceiver::poll(int timeoutMs) {
+	struct pollfd pfd;
+	pfd.fd = socketFd;
+	pfd.events = POLLIN;
+	if (::poll(&pfd, 1, timeoutMs) <= 0)
+		return 0;
+	return receive();
+}
+
+int DatagramReceiver::getFd() {
+	return socketFd;
+}
+
+uint16_t DatagramReceiver::getPort() {
+	struct sockaddr_in address;
+	socklen_t addrlen{sizeof(address)};
+	if (getsockname(socketFd, (struct sockaddr*)&address, &addrlen) != 0)
+		throw std::runtime_error("error on getsockname()");
+	return ntohs(address.sin_port);
+}
+
+size_t DatagramReceiver::getMessageCount() {
+	return messageCount;
+}
+
+size_t DatagramReceiver::getBatchCount() {
+	return batchCount;
+}
+
+size_t DatagramReceiver::getTruncatedCount() {
+	return truncatedCount;
+}
+
 }
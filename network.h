@@ -1,29 +1,342 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include <stdexcept>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
 
+#include "common.h"
+#include "http.h"
+
 namespace network {
 
-class TcpServer {
+/**
+ * Fixed-size receive buffers, recycled instead of freed so that steady
+ * state operation does not allocate.
+ */
+class BufferPool {
+public:
+	static const size_t CHUNK_SIZE{4096};
+
+	struct Chunk {
+		size_t size{0};
+		char data[CHUNK_SIZE];
+	};
+
+	BufferPool(size_t chunksRetainedMax);
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	Chunk* acquire();
+	void release(Chunk* chunk);
+
+	size_t getAllocatedCount();
+	size_t getReusedCount();
+
+private:
+	size_t chunksRetainedMax;
+	std::vector<Chunk*> freeChunks;
+	size_t allocatedCount{0};
+	size_t reusedCount{0};
+};
+
+enum class Framing {
+	UNTIL_EOF,      // one message per connection
+	DELIMITED,      // messages end with a delimiter character
+	LENGTH_PREFIXED, // 32 bit big-endian length, then payload
+	HTTP             // request bodies; connections not starting with a
+	                 // request line fall back to UNTIL_EOF
+};
+
+/**
+ * Reassembles messages from a byte stream that is received into a chain of
+ * pooled chunks. Complete messages are passed on as non-owning views which
+ * are only valid during the handler call. A message spanning several chunks
+ * is linearized once into a reused scratch buffer.
+ */
+class MessageAssembler {
+public:
+	using MessageHandler = std::function<void(common::StringView msg)>;
+
+	MessageAssembler(BufferPool& pool, Framing framing, char delimiter = '\n');
+	~MessageAssembler();
+
+	MessageAssembler(MessageAssembler&& other);
+	MessageAssembler& operator=(MessageAssembler&& other);
+	MessageAssembler(const MessageAssembler&) = delete;
+	MessageAssembler& operator=(const MessageAssembler&) = delete;
+
+	/**
+	 * Free space at the end of the chain to receive into, followed by a
+	 * commit() of the number of bytes actually received.
+	 */
+	char* writePtr();
+	size_t writeSpace();
+	void commit(size_t count);
+
+	void append(const char* data, size_t count);
+
+	/**
+	 * Passes all complete messages to the handler and drops their bytes.
+	 */
+	void extract(const MessageHandler& handler);
+
+	/**
+	 * Signals end of stream; an unterminated trailing message is passed on.
+	 */
+	void finish(const MessageHandler& handler);
+
+	/**
+	 * All unconsumed bytes, valid until the next modification.
+	 */
+	common::StringView contents();
+	size_t size();
+	void clear();
+
+private:
+	common::StringView view(size_t offset, size_t count);
+	size_t find(char c, size_t from);
+	uint8_t byteAt(size_t pos);
+	void consume(size_t count);
+
+private:
+	BufferPool* pool;
+	Framing framing;
+	char delimiter;
+	std::vector<BufferPool::Chunk*> chunks;
+	size_t headOffset{0}; // consumed bytes in the first chunk
+	size_t totalSize{0};  // unconsumed bytes in the chain
+	size_t scanned{0};    // bytes already searched for a delimiter
+	std::vector<char> scratch;
+};
+
+/**
+ * Source of complete client messages, one call per message.
+ */
+class MessageServer {
+public:
+	virtual ~MessageServer() {}
+	virtual std::string receiveClientMsg() = 0;
+};
+
+class TcpServer : public MessageServer {
 public:
 	TcpServer(uint16_t port);
-	std::string receiveClientMsg();
+	std::string receiveClientMsg() override;
+
+	size_t getSyscallCount();
 
 private:
-	const int RECEIVE_BUF_LEN{1500};
 	const int BACKLOG_LEN_MAX{5};
+	size_t syscallCount{0};
 	int createSocket;
 	struct sockaddr_in listenAddress;
-	char rxBuffer[1500];
+	BufferPool pool{4};
+	MessageAssembler assembler{pool, Framing::UNTIL_EOF};
+};
+
+/**
+ * Event loop receiving client messages over TCP. Complete messages, as
+ * determined by the framing, are passed to the handler. See makeTcpServer()
+ * (uring.h) for picking an implementation.
+ */
+class StreamServer {
+public:
+	using MessageHandler = MessageAssembler::MessageHandler;
+	using ReadableHandler = std::function<void()>;
+
+	virtual ~StreamServer() {}
+
+	/**
+	 * Waits at most timeoutMs for socket events and dispatches them.
+	 * A negative timeout waits indefinitely.
+	 */
+	virtual void poll(int timeoutMs) = 0;
+	void run();
+
+	/**
+	 * Dispatches further (level-triggered) file descriptors from the same
+	 * event loop, e.g. a DatagramReceiver.
+	 */
+	virtual void watch(int fd, ReadableHandler readableHandler) = 0;
+
+	virtual uint16_t getPort() = 0;
+
+	static const size_t MESSAGE_LEN_MAX{64 * 1024};
+};
+
+/**
+ * Protocol state of one client connection of a StreamServer. Received
+ * bytes are framed into messages; with Framing::HTTP, connections starting
+ * with a request line are answered and their request bodies are the
+ * messages.
+ */
+class StreamConnection {
+public:
+	using MessageHandler = MessageAssembler::MessageHandler;
+
+	StreamConnection(BufferPool& pool, Framing framing);
+
+	void open(int fd);
+	void close();
+	bool isOpen() const;
+
+	/**
+	 * Free space to receive into, followed by a commit() of the number of
+	 * bytes actually received; or else append() bytes received elsewhere.
+	 * Both return false if the connection is to be closed.
+	 */
+	char* writePtr();
+	size_t writeSpace();
+	bool commit(size_t count, const MessageHandler& handler);
+	bool append(const char* data, size_t count, const MessageHandler& handler);
+
+	/**
+	 * The peer closed the connection; passes on an unterminated message.
+	 */
+	void finish(const MessageHandler& handler);
+
+private:
+	enum class Protocol {
+		UNDECIDED,
+		RAW,
+		HTTP
+	};
+
+	bool process(const MessageHandler& handler);
+	bool parseHttp(const char* data, size_t size, const MessageHandler& handler);
+	void sendResponse(common::StringView response);
+
+private:
+	int fd{-1};
+	Framing framing;
+	Protocol protocol{Protocol::RAW};
+	MessageAssembler assembler;
+	MessageAssembler body;
+	HttpRequestParser httpParser;
+};
+
+/**
+ * Non-blocking, edge-triggered epoll reactor multiplexing the listen socket
+ * and all client sockets.
+ */
+class EpollTcpServer : public StreamServer {
+public:
+	/**
+	 * Port 0 binds to an ephemeral port, see getPort().
+	 *
+	 * With reusePort, several servers (one per thread) can listen on the
+	 * same port and the kernel balances incoming connections among them.
+	 */
+	EpollTcpServer(uint16_t port, MessageHandler handler,
+			Framing framing = Framing::UNTIL_EOF, bool reusePort = false);
+	~EpollTcpServer();
+
+	EpollTcpServer(const EpollTcpServer&) = delete;
+	EpollTcpServer& operator=(const EpollTcpServer&) = delete;
+
+	void poll(int timeoutMs) override;
+	void watch(int fd, ReadableHandler readableHandler) override;
+	uint16_t getPort() override;
+
+	size_t getOpenConnections();
+
+private:
+	void acceptConnections();
+	void receiveFrom(int fd);
+	void closeConnection(int fd);
+
+private:
+	static const int EVENTS_MAX{64};
+	static const size_t CHUNKS_RETAINED_MAX{256};
+	MessageHandler handler;
+	Framing framing;
+	BufferPool pool{CHUNKS_RETAINED_MAX};
+	int listenSocket{-1};
+	int epollFd{-1};
+	size_t openConnections{0};
+	std::vector<StreamConnection> connections; // indexed by file descriptor
+	std::vector<std::pair<int, ReadableHandler>> watched;
+	struct epoll_event events[EVENTS_MAX];
+};
+
+/**
+ * Receives messages as datagrams, one message per datagram, from a UDP port
+ * or an AF_UNIX datagram socket. Many datagrams are drained per recvmmsg()
+ * call, which saves the handshake and per-message syscalls of the TCP path.
+ */
+class DatagramReceiver {
+public:
+	using MessageHandler = MessageAssembler::MessageHandler;
+
+	/**
+	 * UDP on the given port, 0 binds to an ephemeral port.
+	 */
+	DatagramReceiver(uint16_t port, MessageHandler handler);
+
+	/**
+	 * AF_UNIX datagram socket, a stale socket file is replaced.
+	 */
+	DatagramReceiver(const std::string& socketPath, MessageHandler handler);
+	~DatagramReceiver();
+
+	DatagramReceiver(const DatagramReceiver&) = delete;
+	DatagramReceiver& operator=(const DatagramReceiver&) = delete;
+
+	/**
+	 * Passes all pending datagrams to the handler without blocking.
+	 * Returns the number of messages received.
+	 */
+	size_t receive();
+
+	/**
+	 * Waits at most timeoutMs for datagrams, then receives them.
+	 */
+	size_t poll(int timeoutMs);
+
+	int getFd();
+	uint16_t getPort();
+	size_t getMessageCount();
+	size_t getBatchCount();
+	size_t getTruncatedCount();
+
+	static const size_t BATCH_LEN{32};
+
+	/**
+	 * Larger datagrams are dropped rather than parsed truncated.
+	 */
+	static const size_t DATAGRAM_LEN_MAX{8192};
+
+private:
+	void setupBatch();
+
+private:
+	MessageHandler handler;
+	int socketFd{-1};
+	std::string socketPath;
+	std::vector<char> buffers;
+	struct mmsghdr headers[BATCH_LEN];
+	struct iovec iovecs[BATCH_LEN];
+	size_t messageCount{0};
+	size_t batchCount{0};
+	size_t truncatedCount{0};
 };
 
 }
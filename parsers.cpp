@@ -0,0 +1,196 @@
+#include "parsers.h"
+#include "json.h"
+
+namespace parsers {
+
+using common::BuildEvent;
+using common::BuildResult;
+using common::StringView;
+
+namespace {
+
+BuildEvent makeEvent(const rules::RuleSet& statusRules, StringView status,
+		StringView job) {
+	BuildEvent event;
+	if (!status.empty())
+		statusRules.classify(status, event.result);
+	if (!job.empty())
+		event.job = common::fingerprint(job);
+	return event;
+}
+
+} // namespace
+
+GitLabBuildResultParser::GitLabBuildResultParser() :
+	GitLabBuildResultParser({
+		{"success", BuildResult::OK},
+		{"failed", BuildResult::BROKEN}}) {
+}
+
+GitLabBuildResultParser::GitLabBuildResultParser(
+		const std::vector<rules::Rule>& statusRules) :
+	statusRules(std::make_shared<rules::RuleSet>(statusRules)) {
+}
+
+GitLabBuildResultParser::GitLabBuildResultParser(
+		std::shared_ptr<const rules::RuleSet> statusRules) :
+	statusRules(statusRules) {
+}
+
+BuildResult GitLabBuildResultParser::parseMsg(StringView msg) {
+	return parseEvent(msg).result;
+}
+
+BuildEvent GitLabBuildResultParser::parseEvent(StringView msg) {
+	static const json::FieldPath FIELDS[] = {
+		{"object_attributes", "status"}, // pipeline events
+		{"", "build_status"},            // job events
+		{"project", "path_with_namespace"}
+	};
+	StringView values[3];
+	json::extractFields(msg, FIELDS, 3, values);
+	return makeEvent(*statusRules, values[0].empty() ? values[1] : values[0],
+			values[2]);
+}
+
+GitHubBuildResultParser::GitHubBuildResultParser() :
+	GitHubBuildResultParser({
+		{"success", BuildResult::OK},
+		{"failure", BuildResult::BROKEN},
+		{"error", BuildResult::BROKEN}}) {
+}
+
+GitHubBuildResultParser::GitHubBuildResultParser(
+		const std::vector<rules::Rule>& statusRules) :
+	statusRules(std::make_shared<rules::RuleSet>(statusRules)) {
+}
+
+GitHubBuildResultParser::GitHubBuildResultParser(
+		std::shared_ptr<const rules::RuleSet> statusRules) :
+	statusRules(statusRules) {
+}
+
+BuildResult GitHubBuildResultParser::parseMsg(StringView msg) {
+	return parseEvent(msg).result;
+}
+
+BuildEvent GitHubBuildResultParser::parseEvent(StringView msg) {
+	static const json::FieldPath FIELDS[] = {
+		{"workflow_run", "conclusion"},
+		{"check_suite", "conclusion"},
+		{"check_run", "conclusion"},
+		{"", "state"}, // commit status events
+		{"repository", "full_name"},
+		{"", "name"}   // repository of commit status events
+	};
+	StringView values[6];
+	json::extractFields(msg, FIELDS, 6, values);
+
+	StringView status;
+	for (size_t i = 0; i < 4 && status.empty(); i++) {
+		if (values[i] != "null")
+			status = values[i];
+	}
+	return makeEvent(*statusRules, status,
+			values[4].empty() ? values[5] : values[4]);
+}
+
+const size_t ParserRegistry::SNIFFED_KEYS_MAX;
+
+ParserRegistry::ParserRegistry(common::BuildResultParser& defaultParser) :
+	defaultParser(&defaultParser),
+	xmlParser(&defaultParser) {
+}
+
+void ParserRegistry::addJsonParser(const std::string& key,
+		common::BuildResultParser& parser) {
+	jsonParsers.push_back(JsonEntry{key, &parser});
+}
+
+void ParserRegistry::setXmlParser(common::BuildResultParser& parser) {
+	xmlParser = &parser;
+}
+
+common::BuildResultParser& ParserRegistry::select(StringView msg) {
+	size_t start = 0;
+	while (start < msg.size() && (msg[start] == ' ' || msg[start] == '\t' ||
+				msg[start] == '\r' || msg[start] == '\n'))
+		start++;
+	if (start == msg.size())
+		return *defaultParser;
+	if (msg[start] == '<')
+		return *xmlParser;
+
+	if (msg[start] != '{')
+		return *defaultParser;
+
+	// Webhook senders do not keep their members in order, so the distinctive
+	// key need not come first; they do put it among the first few, though.
+	json::JsonReader reader{msg.substr(start)};
+	reader.next();
+	for (size_t keys = 0; keys < SNIFFED_KEYS_MAX &&
+			reader.next() == json::JsonReader::Token::KEY; keys++) {
+		StringView key = reader.getValue();
+		for (auto& entry : jsonParsers) {
+			if (key == StringView{entry.key})
+				return *entry.parser;
+		}
+		if (!reader.skipValue())
+			break;
+	}
+	return *defaultParser;
+}
+
+BuildResult ParserRegistry::parseMsg(StringView msg) {
+	return select(msg).parseMsg(msg);
+}
+
+BuildEvent ParserRegistry::parseEvent(StringView msg) {
+	return select(msg).parseEvent(msg);
+}
+
+std::vector<rules::Rule> defaultStatusRules() {
+	return {
+		{"SUCCESS", BuildResult::OK},
+		{"FAILURE", BuildResult::BROKEN},
+		{"success", BuildResult::OK},
+		{"failed", BuildResult::BROKEN},
+		{"failure", BuildResult::BROKEN},
+		{"error", BuildResult::BROKEN}
+	};
+}
+
+DefaultParsers::DefaultParsers() :
+	registry(jenkins) {
+	registerParsers();
+}
+
+std::vector<rules::Rule> rawMessageRules() {
+	return {
+		{"SUCCESS", BuildResult::OK},
+		{"FAILURE", BuildResult::BROKEN}
+	};
+}
+
+DefaultParsers::DefaultParsers(
+		std::shared_ptr<const rules::RuleSet> statusRules) :
+	jenkins(statusRules, std::make_shared<rules::RuleSet>(rawMessageRules())),
+	gitLab(statusRules),
+	gitHub(statusRules),
+	registry(jenkins) {
+	registerParsers();
+}
+
+void DefaultParsers::registerParsers() {
+	registry.addJsonParser("object_kind", gitLab);
+	registry.addJsonParser("workflow_run", gitHub);
+	registry.addJsonParser("check_suite", gitHub);
+	registry.addJsonParser("check_run", gitHub);
+	registry.addJsonParser("context", gitHub); // commit status events
+}
+
+ParserRegistry& DefaultParsers::getRegistry() {
+	return registry;
+}
+
+} // namespace parsers
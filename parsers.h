@@ -0,0 +1,122 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "rules.h"
+
+namespace parsers {
+
+/**
+ * GitLab pipeline and job webhooks: object_attributes.status or
+ * build_status, classified by status rules (default: success is OK, failed
+ * is BROKEN). The job is the project path.
+ */
+class GitLabBuildResultParser : public common::BuildResultParser {
+public:
+	GitLabBuildResultParser();
+	GitLabBuildResultParser(const std::vector<rules::Rule>& statusRules);
+	GitLabBuildResultParser(std::shared_ptr<const rules::RuleSet> statusRules);
+
+	common::BuildResult parseMsg(common::StringView msg) override;
+	common::BuildEvent parseEvent(common::StringView msg) override;
+
+private:
+	std::shared_ptr<const rules::RuleSet> statusRules;
+};
+
+/**
+ * GitHub workflow_run, check_suite and check_run webhooks (conclusion) and
+ * commit status webhooks (state), classified by status rules (default:
+ * success is OK, failure and error are BROKEN). The job is the repository
+ * name.
+ */
+class GitHubBuildResultParser : public common::BuildResultParser {
+public:
+	GitHubBuildResultParser();
+	GitHubBuildResultParser(const std::vector<rules::Rule>& statusRules);
+	GitHubBuildResultParser(std::shared_ptr<const rules::RuleSet> statusRules);
+
+	common::BuildResult parseMsg(common::StringView msg) override;
+	common::BuildEvent parseEvent(common::StringView msg) override;
+
+private:
+	std::shared_ptr<const rules::RuleSet> statusRules;
+};
+
+/**
+ * Hands each message to the parser for its format: JSON objects by the
+ * first of their top-level keys that is registered, looking at no more than
+ * SNIFFED_KEYS_MAX keys and skipping their values without tokenizing them,
+ * XML by its leading '<'. Anything else, or a JSON object without a
+ * registered key among those, goes to the default parser.
+ *
+ * The registry does not own the parsers.
+ */
+class ParserRegistry : public common::BuildResultParser {
+public:
+	ParserRegistry(common::BuildResultParser& defaultParser);
+
+	static const size_t SNIFFED_KEYS_MAX{16};
+
+	/**
+	 * JSON objects with a top-level member key. Keys should be distinctive
+	 * of the format, as the first registered key found decides.
+	 */
+	void addJsonParser(const std::string& key,
+			common::BuildResultParser& parser);
+	void setXmlParser(common::BuildResultParser& parser);
+
+	common::BuildResultParser& select(common::StringView msg);
+
+	common::BuildResult parseMsg(common::StringView msg) override;
+	common::BuildEvent parseEvent(common::StringView msg) override;
+
+private:
+	struct JsonEntry {
+		std::string key;
+		common::BuildResultParser* parser;
+	};
+
+	common::BuildResultParser* defaultParser;
+	common::BuildResultParser* xmlParser;
+	std::vector<JsonEntry> jsonParsers;
+};
+
+/**
+ * The default status rules of all parsers together, for a RuleSet shared by
+ * them. They are meant for the status fields the parsers extract.
+ */
+std::vector<rules::Rule> defaultStatusRules();
+
+/**
+ * Rules for messages in no known format, which are classified as a whole:
+ * only the upper-case Jenkins results, as lower-case words like "error"
+ * occur in any text.
+ */
+std::vector<rules::Rule> rawMessageRules();
+
+/**
+ * Parsers for the CI systems known here, registered by their signatures.
+ * Each has its own default status rules unless they share statusRules;
+ * messages in no known format are then classified by rawMessageRules().
+ */
+class DefaultParsers {
+public:
+	DefaultParsers();
+	DefaultParsers(std::shared_ptr<const rules::RuleSet> statusRules);
+
+	ParserRegistry& getRegistry();
+
+private:
+	void registerParsers();
+
+	common::JenkinsBuildResultParser jenkins;
+	GitLabBuildResultParser gitLab;
+	GitHubBuildResultParser gitHub;
+	ParserRegistry registry;
+};
+
+} // namespace parsers
@@ -0,0 +1,324 @@
+#include <algorithm>
+
+#include "pipeline.h"
+
+namespace pipeline {
+
+using common::BuildEvent;
+using common::BuildResult;
+
+uint64_t nextSequence() {
+	static std::atomic<uint64_t> sequence{0};
+	return sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+Coalescer::Coalescer(std::chrono::milliseconds window, ClockFunction clock) :
+	window(window),
+	clock(clock) {
+}
+
+void Coalescer::add(const common::BuildEvent& event) {
+	stats.received++;
+	if (event.result == BuildResult::DONTKNOW) {
+		stats.coalesced++;
+		return;
+	}
+
+	if (!pending) {
+		pending = true;
+		deadline = clock() + window;
+	}
+
+	eventsInWindow++;
+	last = event.result;
+	if (event.result == BuildResult::BROKEN)
+		brokenSeen = true;
+	if (event.statisticsChanged)
+		statisticsChanged = true;
+}
+
+bool Coalescer::isPending() const {
+	return pending;
+}
+
+bool Coalescer::isDue() const {
+	return pending && clock() >= deadline;
+}
+
+Coalescer::Clock::time_point Coalescer::getDeadline() const {
+	return deadline;
+}
+
+void Coalescer::flush(const ApplyFunction& apply) {
+	if (!pending)
+		return;
+
+	size_t merged = 0;
+	if (brokenSeen) {
+		apply(BuildResult::BROKEN);
+		lastApplied = BuildResult::BROKEN;
+		merged++;
+	}
+	if (last != lastApplied ||
+			(statisticsChanged && last == BuildResult::OK)) {
+		apply(last);
+		lastApplied = last;
+		merged++;
+	}
+
+	stats.applied += merged;
+	stats.coalesced += eventsInWindow - merged;
+
+	eventsInWindow = 0;
+	pending = false;
+	brokenSeen = false;
+	statisticsChanged = false;
+}
+
+Coalescer::Stats Coalescer::getStats() const {
+	return stats;
+}
+
+const size_t Deduplicator::PROBE_LEN;
+
+Deduplicator::Deduplicator(size_t slots, std::chrono::milliseconds window,
+		ClockFunction clock) :
+	table(slots),
+	mask(slots - 1),
+	window(window),
+	clock(clock) {
+	if (slots < PROBE_LEN || (slots & (slots - 1)) != 0)
+		throw std::invalid_argument("slots must be a power of two >= 8");
+}
+
+bool Deduplicator::admit(common::StringView msg) {
+	received.fetch_add(1, std::memory_order_relaxed);
+	uint64_t fp = common::fingerprint(msg);
+	Clock::rep now = clock().time_since_epoch().count();
+
+	// Reuse the first free (empty or expired) slot of the probe run, or else
+	// the live one closest to expiry.
+	Slot* victim = nullptr;
+	uint64_t victimFingerprint = 0;
+	Clock::rep victimExpiry = 0;
+	bool victimFree = false;
+	for (size_t i = 0; i < PROBE_LEN; i++) {
+		Slot& slot = table[(fp + i) & mask];
+		uint64_t slotFingerprint = slot.fingerprint.load(std::memory_order_acquire);
+		Clock::rep expiry = slot.expiry.load(std::memory_order_relaxed);
+		bool live = slotFingerprint != 0 && expiry > now;
+		if (live && slotFingerprint == fp) {
+			duplicates.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		if (victimFree)
+			continue;
+		if (!live || !victim || expiry < victimExpiry) {
+			victim = &slot;
+			victimFingerprint = slotFingerprint;
+			victimExpiry = expiry;
+			victimFree = !live;
+		}
+	}
+
+	if (!victimFree)
+		evicted.fetch_add(1, std::memory_order_relaxed);
+	// If another thread took the slot meanwhile, msg is not remembered.
+	if (victim->fingerprint.compare_exchange_strong(victimFingerprint, fp,
+				std::memory_order_acq_rel)) {
+		victim->expiry.store(now + std::chrono::duration_cast<Clock::duration>(
+					window).count(), std::memory_order_relaxed);
+	}
+	return true;
+}
+
+Deduplicator::Stats Deduplicator::getStats() const {
+	Stats stats;
+	stats.received = received.load(std::memory_order_relaxed);
+	stats.duplicates = duplicates.load(std::memory_order_relaxed);
+	stats.evicted = evicted.load(std::memory_order_relaxed);
+	return stats;
+}
+
+const uint32_t JobTable::NO_JOB;
+constexpr double JobTable::DECAY;
+constexpr double JobTable::FLAKY_FLIP_RATE;
+const size_t JobTable::FLAKY_MIN_BUILDS;
+
+JobTable::JobTable(size_t jobsMax, ClockFunction clock) :
+	jobsMax(jobsMax),
+	clock(clock) {
+	// At most half full, so probe runs stay short.
+	size_t size = 16;
+	while (size < 2 * jobsMax)
+		size *= 2;
+	slots.resize(size);
+	mask = size - 1;
+	jobs.reserve(jobsMax);
+}
+
+BuildEvent JobTable::update(const BuildEvent& event) {
+	if (event.result == BuildResult::DONTKNOW)
+		return BuildEvent{};
+
+	uint32_t index = intern(event.job);
+	if (index == NO_JOB) {
+		untrackedCount++;
+		return (event.result == BuildResult::BROKEN) ? event : BuildEvent{};
+	}
+
+	JobState& job = jobs[index];
+	if (event.sequence != 0 && event.sequence < job.sequence) {
+		staleCount++;
+		return BuildEvent{};
+	}
+	job.sequence = event.sequence;
+	bool flakyBefore = flakyCount > 0;
+	record(job, event.result);
+
+	BuildResult before = getAggregate();
+	if (job.result != event.result) {
+		if (job.result == BuildResult::BROKEN)
+			brokenCount--;
+		else if (job.result == BuildResult::OK)
+			okCount--;
+
+		if (event.result == BuildResult::BROKEN)
+			brokenCount++;
+		else
+			okCount++;
+		job.result = event.result;
+	}
+
+	if (event.result == BuildResult::BROKEN)
+		return event;
+	BuildResult after = getAggregate();
+	if (after != before)
+		return BuildEvent{after};
+	if (after == BuildResult::OK && (flakyCount > 0) != flakyBefore) {
+		BuildEvent changed{after};
+		changed.statisticsChanged = true;
+		return changed;
+	}
+	return BuildEvent{};
+}
+
+BuildResult JobTable::getAggregate() const {
+	if (brokenCount > 0)
+		return BuildResult::BROKEN;
+	if (okCount > 0)
+		return BuildResult::OK;
+	return BuildResult::DONTKNOW;
+}
+
+bool JobTable::getResult(uint64_t job, BuildResult& result) const {
+	uint32_t index = find(job);
+	if (index == NO_JOB)
+		return false;
+	result = jobs[index].result;
+	return true;
+}
+
+size_t JobTable::getJobCount() const {
+	return jobs.size();
+}
+
+size_t JobTable::getBrokenCount() const {
+	return brokenCount;
+}
+
+size_t JobTable::getStaleCount() const {
+	return staleCount;
+}
+
+size_t JobTable::getUntrackedCount() const {
+	return untrackedCount;
+}
+
+size_t JobTable::getFlakyJobCount() const {
+	return flakyCount;
+}
+
+bool JobTable::getJobStatistics(uint64_t job,
+		common::JobStatistics& statistics) const {
+	uint32_t index = find(job);
+	if (index == NO_JOB)
+		return false;
+
+	const JobState& state = jobs[index];
+	statistics.builds = state.builds;
+	statistics.failureRate = state.failureRate;
+	statistics.flipRate = state.flipRate;
+	statistics.windowBuilds = std::min<size_t>(state.builds,
+			common::JobStatistics::WINDOW_LEN);
+	statistics.windowFailures = __builtin_popcountll(state.failureHistory);
+	statistics.windowFlips = __builtin_popcountll(state.flipHistory);
+	statistics.lastTimeToGreen = state.lastTimeToGreen;
+	statistics.meanTimeToGreen = state.meanTimeToGreen;
+	statistics.broken = state.result == BuildResult::BROKEN;
+	statistics.flaky = state.flaky;
+	return true;
+}
+
+void JobTable::record(JobState& job, BuildResult result) {
+	bool failed = result == BuildResult::BROKEN;
+	bool flipped = job.builds > 0 && result != job.result;
+
+	// The first build sets the rates rather than decaying from zero.
+	double weight = (job.builds == 0) ? 1.0 : DECAY;
+	job.failureRate += weight * ((failed ? 1.0 : 0.0) - job.failureRate);
+	job.flipRate += weight * ((flipped ? 1.0 : 0.0) - job.flipRate);
+	job.failureHistory = (job.failureHistory << 1) | (failed ? 1 : 0);
+	job.flipHistory = (job.flipHistory << 1) | (flipped ? 1 : 0);
+	job.builds++;
+
+	if (failed && job.result != BuildResult::BROKEN) {
+		job.brokenSince = clock();
+	} else if (!failed && job.result == BuildResult::BROKEN) {
+		job.lastTimeToGreen = clock() - job.brokenSince;
+		if (job.meanTimeToGreen == Clock::duration::zero()) {
+			job.meanTimeToGreen = job.lastTimeToGreen;
+		} else {
+			job.meanTimeToGreen += std::chrono::duration_cast<Clock::duration>(
+					DECAY * (job.lastTimeToGreen - job.meanTimeToGreen));
+		}
+	}
+
+	bool flaky = job.builds >= FLAKY_MIN_BUILDS &&
+		job.flipRate >= FLAKY_FLIP_RATE;
+	if (flaky != job.flaky) {
+		job.flaky = flaky;
+		if (flaky)
+			flakyCount++;
+		else
+			flakyCount--;
+	}
+}
+
+uint32_t JobTable::intern(uint64_t job) {
+	// Job keys are already hashes.
+	for (size_t i = job & mask; ; i = (i + 1) & mask) {
+		Slot& slot = slots[i];
+		if (slot.index == NO_JOB) {
+			if (jobs.size() == jobsMax)
+				return NO_JOB;
+			slot.job = job;
+			slot.index = jobs.size();
+			jobs.push_back(JobState{});
+			return slot.index;
+		}
+		if (slot.job == job)
+			return slot.index;
+	}
+}
+
+uint32_t JobTable::find(uint64_t job) const {
+	for (size_t i = job & mask; ; i = (i + 1) & mask) {
+		const Slot& slot = slots[i];
+		if (slot.index == NO_JOB || slot.job == job)
+			return slot.index;
+	}
+}
+
+} // namespace pipeline
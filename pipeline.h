@@ -0,0 +1,609 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+
+namespace pipeline {
+
+/**
+ * Wakes up a consumer sleeping on one or more lock-free queues. ring() only
+ * takes the mutex while the consumer is actually sleeping.
+ */
+class Doorbell {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	void ring() {
+		// Pairs with the fence in sleepUntil(): either the consumer sees the
+		// new element or we see it sleeping.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (consumerSleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			wakeup.notify_one();
+		}
+	}
+
+	/**
+	 * Sleeps until ready() holds or the deadline (if any) has passed.
+	 */
+	template<typename Predicate>
+	bool sleepUntil(Predicate ready, const Clock::time_point* deadline) {
+		std::unique_lock<std::mutex> lock(mutex);
+		consumerSleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		bool isReady = true;
+		if (deadline)
+			isReady = wakeup.wait_until(lock, *deadline, ready);
+		else
+			wakeup.wait(lock, ready);
+
+		consumerSleeping.store(false, std::memory_order_relaxed);
+		return isReady;
+	}
+
+private:
+	std::atomic<bool> consumerSleeping{false};
+	std::mutex mutex;
+	std::condition_variable wakeup;
+};
+
+/**
+ * Bounded lock-free single-producer/single-consumer ring.
+ *
+ * Push and pop only use atomic loads and stores. A consumer that runs out of
+ * work may block in waitPop() on the queue's doorbell, which can be shared
+ * by several queues (see FanInQueue).
+ */
+template<typename T, size_t CAPACITY>
+class SpscQueue {
+	static_assert(CAPACITY >= 2 && (CAPACITY & (CAPACITY - 1)) == 0,
+			"capacity must be a power of two");
+
+public:
+	SpscQueue() :
+		doorbell(ownDoorbell) {
+	}
+
+	SpscQueue(Doorbell& doorbell) :
+		doorbell(doorbell) {
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	/**
+	 * Producer side. Returns false and counts the element as dropped if the
+	 * ring is full.
+	 */
+	bool push(const T& element) {
+		size_t tail = tailIndex.load(std::memory_order_relaxed);
+		if (tail - cachedHead == CAPACITY) {
+			cachedHead = headIndex.load(std::memory_order_acquire);
+			if (tail - cachedHead == CAPACITY) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		elements[tail & (CAPACITY - 1)] = element;
+		tailIndex.store(tail + 1, std::memory_order_release);
+		doorbell.ring();
+		return true;
+	}
+
+	/**
+	 * Consumer side, never blocks.
+	 */
+	bool tryPop(T& element) {
+		size_t head = headIndex.load(std::memory_order_relaxed);
+		if (head == cachedTail) {
+			cachedTail = tailIndex.load(std::memory_order_acquire);
+			if (head == cachedTail)
+				return false;
+		}
+
+		element = elements[head & (CAPACITY - 1)];
+		headIndex.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Consumer side, blocks until an element is available.
+	 */
+	void waitPop(T& element) {
+		while (!tryPop(element))
+			doorbell.sleepUntil([this] { return !empty(); }, nullptr);
+	}
+
+	/**
+	 * Consumer side, blocks until an element is available or the deadline
+	 * has passed.
+	 */
+	bool waitPopUntil(T& element, Doorbell::Clock::time_point deadline) {
+		while (!tryPop(element)) {
+			if (!doorbell.sleepUntil([this] { return !empty(); }, &deadline))
+				return tryPop(element);
+		}
+		return true;
+	}
+
+	/**
+	 * Consumer side.
+	 */
+	bool empty() const {
+		return headIndex.load(std::memory_order_relaxed) ==
+			tailIndex.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Producer side, number of elements not yet consumed.
+	 */
+	size_t size() const {
+		return tailIndex.load(std::memory_order_relaxed) -
+			headIndex.load(std::memory_order_acquire);
+	}
+
+	size_t getDroppedCount() const {
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	// Padding keeps consumer and producer indices on separate cache lines
+	// (alignas would need C++17 aligned new for heap allocated queues).
+	static const size_t CACHE_LINE{64};
+
+	T elements[CAPACITY];
+
+	char padding0[CACHE_LINE];
+	std::atomic<size_t> headIndex{0};
+	size_t cachedTail{0}; // consumer's copy of tailIndex
+
+	char padding1[CACHE_LINE];
+	std::atomic<size_t> tailIndex{0};
+	size_t cachedHead{0}; // producer's copy of headIndex
+	std::atomic<size_t> dropped{0};
+
+	char padding2[CACHE_LINE];
+	Doorbell ownDoorbell;
+	Doorbell& doorbell;
+};
+
+/**
+ * Process-wide admission order of build events, comparable across
+ * producers.
+ */
+uint64_t nextSequence();
+
+/**
+ * Admission stage for build events with fixed memory, so that a flood of
+ * irrelevant results can neither exhaust memory nor delay a failure:
+ *
+ * - BROKEN results take a lock-free priority lane that the consumer always
+ *   drains first. A BROKEN result that finds the lane full goes to an
+ *   overflow slot of its own, replacing an older BROKEN result there, but
+ *   never displaced by any other result.
+ * - OK and DONTKNOW results share a bulk lane that drops its oldest event
+ *   when full, so the newest results get through.
+ * - DONTKNOW results never change the signal and are shed right away once
+ *   the bulk lane holds dontKnowLimit events.
+ *
+ * Events are stamped with nextSequence() on push, so that the consumer can
+ * tell stale events of a job from newer ones (see JobTable). The queue
+ * itself never drops an event by its sequence: the lanes are popped
+ * independently, so an event may come out after a newer one of another
+ * job. The bulk lane is guarded by a mutex shared only by the producer and
+ * the consumer; BROKEN results only take a lock once their lane is full.
+ */
+template<size_t CAPACITY, size_t PRIORITY_CAPACITY = 16>
+class AdmissionQueue {
+public:
+	struct Stats {
+		size_t admitted{0};
+		size_t shedDontKnow{0};
+		size_t shedOverflow{0}; // oldest OK results dropped from the bulk lane
+		size_t shedBroken{0};   // BROKEN results replaced in the overflow slot
+	};
+
+	AdmissionQueue(Doorbell& doorbell, size_t dontKnowLimit = CAPACITY / 2) :
+		doorbell(doorbell),
+		priority(doorbell),
+		dontKnowLimit(dontKnowLimit) {
+	}
+
+	AdmissionQueue(const AdmissionQueue&) = delete;
+	AdmissionQueue& operator=(const AdmissionQueue&) = delete;
+
+	/**
+	 * Producer side. Returns false if the event was shed right away.
+	 */
+	bool push(common::BuildEvent event) {
+		event.sequence = nextSequence();
+
+		if (event.result == common::BuildResult::BROKEN) {
+			if (!priority.push(event)) {
+				{
+					std::lock_guard<std::mutex> lock(overflowMutex);
+					if (overflowPending.load(std::memory_order_relaxed))
+						shedBroken.fetch_add(1, std::memory_order_relaxed);
+					overflow = event;
+					overflowPending.store(true, std::memory_order_release);
+				}
+				doorbell.ring();
+			}
+		} else if (!pushBulk(event)) {
+			shedDontKnow.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		admitted.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/**
+	 * Consumer side, never blocks.
+	 */
+	bool tryPop(common::BuildEvent& event) {
+		return priority.tryPop(event) || popOverflow(event) || popBulk(event);
+	}
+
+	/**
+	 * Consumer side.
+	 */
+	bool empty() const {
+		return priority.empty() &&
+			!overflowPending.load(std::memory_order_acquire) &&
+			bulkCount.load(std::memory_order_acquire) == 0;
+	}
+
+	Stats getStats() const {
+		Stats stats;
+		stats.admitted = admitted.load(std::memory_order_relaxed);
+		stats.shedDontKnow = shedDontKnow.load(std::memory_order_relaxed);
+		stats.shedOverflow = shedOverflow.load(std::memory_order_relaxed);
+		stats.shedBroken = shedBroken.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	/**
+	 * All events shed so far.
+	 */
+	size_t getDroppedCount() const {
+		Stats stats = getStats();
+		return stats.shedDontKnow + stats.shedOverflow + stats.shedBroken;
+	}
+
+private:
+	bool pushBulk(const common::BuildEvent& event) {
+		{
+			std::lock_guard<std::mutex> lock(bulkMutex);
+			size_t count = bulkCount.load(std::memory_order_relaxed);
+			if (event.result == common::BuildResult::DONTKNOW &&
+					count >= dontKnowLimit)
+				return false;
+
+			if (count == CAPACITY) {
+				if (bulk[bulkHead].result == common::BuildResult::DONTKNOW)
+					shedDontKnow.fetch_add(1, std::memory_order_relaxed);
+				else
+					shedOverflow.fetch_add(1, std::memory_order_relaxed);
+				bulkHead = (bulkHead + 1) % CAPACITY;
+				count--;
+			}
+			bulk[(bulkHead + count) % CAPACITY] = event;
+			bulkCount.store(count + 1, std::memory_order_release);
+		}
+		doorbell.ring();
+		return true;
+	}
+
+	bool popBulk(common::BuildEvent& event) {
+		if (bulkCount.load(std::memory_order_acquire) == 0)
+			return false;
+		std::lock_guard<std::mutex> lock(bulkMutex);
+		size_t count = bulkCount.load(std::memory_order_relaxed);
+		if (count == 0)
+			return false;
+		event = bulk[bulkHead];
+		bulkHead = (bulkHead + 1) % CAPACITY;
+		bulkCount.store(count - 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool popOverflow(common::BuildEvent& event) {
+		if (!overflowPending.load(std::memory_order_acquire))
+			return false;
+		std::lock_guard<std::mutex> lock(overflowMutex);
+		event = overflow;
+		overflowPending.store(false, std::memory_order_relaxed);
+		return true;
+	}
+
+private:
+	Doorbell& doorbell;
+	SpscQueue<common::BuildEvent, PRIORITY_CAPACITY> priority;
+	const size_t dontKnowLimit;
+
+	std::mutex overflowMutex;
+	common::BuildEvent overflow; // a BROKEN result
+	std::atomic<bool> overflowPending{false};
+
+	std::mutex bulkMutex;
+	common::BuildEvent bulk[CAPACITY];
+	size_t bulkHead{0};
+	std::atomic<size_t> bulkCount{0};
+
+	std::atomic<size_t> admitted{0};
+	std::atomic<size_t> shedDontKnow{0};
+	std::atomic<size_t> shedOverflow{0};
+	std::atomic<size_t> shedBroken{0};
+};
+
+/**
+ * Merges several producers into one consumer, giving each producer its own
+ * queue (an SPSC ring by default) so that pushing stays lock-free. The
+ * consumer serves the queues round-robin and sleeps on a shared doorbell.
+ */
+template<typename T, size_t CAPACITY, typename Queue = SpscQueue<T, CAPACITY>>
+class FanInQueue {
+public:
+	FanInQueue(size_t producers) {
+		for (size_t i = 0; i < producers; i++)
+			queues.emplace_back(new Queue(doorbell));
+	}
+
+	Queue& getProducerQueue(size_t producer) {
+		return *queues[producer];
+	}
+
+	size_t getProducerCount() const {
+		return queues.size();
+	}
+
+	bool tryPop(T& element) {
+		for (size_t i = 0; i < queues.size(); i++) {
+			size_t idx = next;
+			next = (next + 1 == queues.size()) ? 0 : next + 1;
+			if (queues[idx]->tryPop(element))
+				return true;
+		}
+		return false;
+	}
+
+	void waitPop(T& element) {
+		while (!tryPop(element))
+			doorbell.sleepUntil([this] { return !empty(); }, nullptr);
+	}
+
+	bool waitPopUntil(T& element, Doorbell::Clock::time_point deadline) {
+		while (!tryPop(element)) {
+			if (!doorbell.sleepUntil([this] { return !empty(); }, &deadline))
+				return tryPop(element);
+		}
+		return true;
+	}
+
+	size_t getDroppedCount() const {
+		size_t dropped = 0;
+		for (auto& queue : queues)
+			dropped += queue->getDroppedCount();
+		return dropped;
+	}
+
+private:
+	bool empty() const {
+		for (auto& queue : queues) {
+			if (!queue->empty())
+				return false;
+		}
+		return true;
+	}
+
+private:
+	Doorbell doorbell;
+	std::vector<std::unique_ptr<Queue>> queues;
+	size_t next{0};
+};
+
+/**
+ * Collapses bursts of build events into the effective final state.
+ *
+ * The first relevant event opens a window; when it is due, flush() applies
+ * the last result seen if it differs from the one applied before, or if it
+ * is OK and an event in the window had statisticsChanged set. A BROKEN
+ * result in the window is never lost: it is applied (and beeps) even if the
+ * window ends with OK.
+ */
+class Coalescer {
+public:
+	using Clock = std::chrono::steady_clock;
+	using ClockFunction = std::function<Clock::time_point()>;
+	using ApplyFunction = std::function<void(common::BuildResult)>;
+
+	struct Stats {
+		size_t received{0};
+		size_t applied{0};
+		size_t coalesced{0}; // received events that did not cause an update
+	};
+
+	Coalescer(std::chrono::milliseconds window, ClockFunction clock = Clock::now);
+
+	void add(const common::BuildEvent& event);
+
+	bool isPending() const;
+	bool isDue() const;
+	Clock::time_point getDeadline() const;
+
+	void flush(const ApplyFunction& apply);
+
+	Stats getStats() const;
+
+private:
+	std::chrono::milliseconds window;
+	ClockFunction clock;
+	Clock::time_point deadline;
+	bool pending{false};
+	bool brokenSeen{false};
+	bool statisticsChanged{false};
+	size_t eventsInWindow{0};
+	common::BuildResult last{common::BuildResult::DONTKNOW};
+	common::BuildResult lastApplied{common::BuildResult::DONTKNOW};
+	Stats stats;
+};
+
+/**
+ * Drops retried deliveries: a payload identical to one seen within the
+ * window is a duplicate. Payloads are remembered by a 64-bit fingerprint in
+ * a fixed open-addressing table with short linear probing, so memory is
+ * bounded and each message costs O(1) table operations. When all slots of a
+ * probe run are live, the one closest to expiry is evicted.
+ *
+ * Lock-free, so that the acceptors of SO_REUSEPORT listen sockets share one
+ * table: a retry comes on a new connection, which the kernel may hand to
+ * any of them. Only identical payloads admitted at the same moment by two
+ * threads may both get through.
+ */
+class Deduplicator {
+public:
+	using Clock = std::chrono::steady_clock;
+	using ClockFunction = std::function<Clock::time_point()>;
+
+	struct Stats {
+		size_t received{0};
+		size_t duplicates{0};
+		size_t evicted{0}; // live fingerprints pushed out by a full probe run
+	};
+
+	/**
+	 * slots must be a power of two.
+	 */
+	Deduplicator(size_t slots, std::chrono::milliseconds window,
+			ClockFunction clock = Clock::now);
+
+	/**
+	 * Returns false if msg is a duplicate within the window.
+	 */
+	bool admit(common::StringView msg);
+
+	Stats getStats() const;
+
+private:
+	static const size_t PROBE_LEN{8};
+
+	struct Slot {
+		std::atomic<uint64_t> fingerprint{0}; // 0 marks an empty slot
+		std::atomic<Clock::rep> expiry{0};    // since the clock's epoch
+	};
+
+	std::vector<Slot> table;
+	size_t mask;
+	std::chrono::milliseconds window;
+	ClockFunction clock;
+	std::atomic<size_t> received{0};
+	std::atomic<size_t> duplicates{0};
+	std::atomic<size_t> evicted{0};
+};
+
+/**
+ * Build state per job and the aggregate over all jobs, for monitoring many
+ * jobs with one light.
+ *
+ * Jobs are interned by the fingerprint of their name (BuildEvent::job) into
+ * dense indices through a flat open-addressing table with linear probing.
+ * Both are allocated up front for jobsMax jobs. The number of broken and
+ * green jobs is maintained on every update, so the aggregate costs O(1)
+ * regardless of the number of jobs. Unnamed events share one job.
+ *
+ * Each job also keeps streaming statistics (see common::JobStatistics),
+ * updated in O(1) per build with fixed memory: exponentially decayed rates
+ * plus bit histories of the last 64 builds. A job is flaky while its decayed
+ * flip rate is at least FLAKY_FLIP_RATE after FLAKY_MIN_BUILDS builds.
+ */
+class JobTable : public common::BuildStatistics {
+public:
+	using Clock = std::chrono::steady_clock;
+	using ClockFunction = std::function<Clock::time_point()>;
+
+	static constexpr double DECAY{0.1}; // weight of the latest build
+	static constexpr double FLAKY_FLIP_RATE{0.3};
+	static const size_t FLAKY_MIN_BUILDS{8};
+
+	JobTable(size_t jobsMax, ClockFunction clock = Clock::now);
+
+	/**
+	 * Records event for its job and returns what to signal: every BROKEN
+	 * result (a new failure), otherwise the aggregate if it changed, and
+	 * DONTKNOW if nothing changed. While the aggregate stays OK, the first
+	 * job turning flaky and the last one settling are signalled as OK with
+	 * statisticsChanged set, so that the light can switch between green and
+	 * amber. Events older than the last one recorded for the job (by
+	 * sequence) are ignored.
+	 */
+	common::BuildEvent update(const common::BuildEvent& event);
+
+	/**
+	 * BROKEN if any job is broken, else OK if any job is green.
+	 */
+	common::BuildResult getAggregate() const;
+
+	bool getResult(uint64_t job, common::BuildResult& result) const;
+
+	size_t getJobCount() const;
+	size_t getBrokenCount() const;
+	size_t getStaleCount() const;
+	size_t getUntrackedCount() const; // events of jobs beyond jobsMax
+
+	size_t getFlakyJobCount() const override;
+	bool getJobStatistics(uint64_t job,
+			common::JobStatistics& statistics) const override;
+
+private:
+	static const uint32_t NO_JOB{UINT32_MAX};
+
+	struct Slot {
+		uint64_t job{0};
+		uint32_t index{NO_JOB};
+	};
+
+	struct JobState {
+		common::BuildResult result{common::BuildResult::DONTKNOW};
+		uint64_t sequence{0};
+
+		size_t builds{0};
+		double failureRate{0};
+		double flipRate{0};
+		uint64_t failureHistory{0}; // bit 0 is the latest build
+		uint64_t flipHistory{0};
+		Clock::time_point brokenSince;
+		Clock::duration lastTimeToGreen{0};
+		Clock::duration meanTimeToGreen{0};
+		bool flaky{false};
+	};
+
+	uint32_t intern(uint64_t job);
+	uint32_t find(uint64_t job) const;
+	void record(JobState& job, common::BuildResult result);
+
+	std::vector<Slot> slots;
+	size_t mask;
+	size_t jobsMax;
+	std::vector<JobState> jobs; // by interned index
+
+	size_t brokenCount{0};
+	size_t okCount{0};
+	size_t staleCount{0};
+	size_t untrackedCount{0};
+	size_t flakyCount{0};
+
+	ClockFunction clock;
+};
+
+} // namespace pipeline
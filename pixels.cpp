@@ -0,0 +1,160 @@
+#include "pixels.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pixels {
+
+using common::LightSetting;
+
+PixelStrip::PixelStrip(size_t pixels, PixelSink& sink) :
+	pixels(pixels),
+	sink(sink),
+	buffers(6 * pixels, 0),
+	dirtyFirst(pixels) {
+}
+
+size_t PixelStrip::size() const {
+	return pixels;
+}
+
+void PixelStrip::set(size_t pixel, LightSetting value) {
+	if (pixel >= pixels) {
+		printf("ERROR: pixel %zu beyond a strip of %zu.\n", pixel, pixels);
+		return;
+	}
+	channel(BACK, 0)[pixel] = value.r;
+	channel(BACK, 1)[pixel] = value.g;
+	channel(BACK, 2)[pixel] = value.b;
+	if (!differs(pixel))
+		return;
+	if (pixel < dirtyFirst)
+		dirtyFirst = pixel;
+	if (pixel >= dirtyEnd)
+		dirtyEnd = pixel + 1;
+}
+
+LightSetting PixelStrip::get(size_t pixel) const {
+	if (pixel >= pixels)
+		return LightSetting{};
+	return LightSetting{channel(BACK, 0)[pixel], channel(BACK, 1)[pixel],
+		channel(BACK, 2)[pixel]};
+}
+
+void PixelStrip::fill(LightSetting value) {
+	memset(channel(BACK, 0), value.r, pixels);
+	memset(channel(BACK, 1), value.g, pixels);
+	memset(channel(BACK, 2), value.b, pixels);
+	dirtyFirst = 0;
+	dirtyEnd = pixels;
+}
+
+bool PixelStrip::flush() {
+	// Pixels set back to what is shown may have left the range too wide.
+	while (dirtyFirst < dirtyEnd && !differs(dirtyFirst))
+		dirtyFirst++;
+	while (dirtyEnd > dirtyFirst && !differs(dirtyEnd - 1))
+		dirtyEnd--;
+	if (dirtyFirst >= dirtyEnd) {
+		dirtyFirst = pixels;
+		dirtyEnd = 0;
+		return false;
+	}
+
+	size_t count = dirtyEnd - dirtyFirst;
+	sink.write(dirtyFirst, count, channel(BACK, 0), channel(BACK, 1),
+			channel(BACK, 2));
+	for (int c = 0; c < 3; c++)
+		memcpy(channel(FRONT, c) + dirtyFirst, channel(BACK, c) + dirtyFirst, count);
+
+	stats.flushes++;
+	stats.pixelsWritten += count;
+	dirtyFirst = pixels;
+	dirtyEnd = 0;
+	return true;
+}
+
+PixelStrip::Stats PixelStrip::getStats() const {
+	return stats;
+}
+
+uint8_t* PixelStrip::channel(Buffer buffer, int channel) {
+	return buffers.data() + (3 * buffer + channel) * pixels;
+}
+
+const uint8_t* PixelStrip::channel(Buffer buffer, int channel) const {
+	return buffers.data() + (3 * buffer + channel) * pixels;
+}
+
+bool PixelStrip::differs(size_t pixel) const {
+	for (int c = 0; c < 3; c++) {
+		if (channel(FRONT, c)[pixel] != channel(BACK, c)[pixel])
+			return true;
+	}
+	return false;
+}
+
+RgbLightSink::RgbLightSink(const std::vector<common::RgbLight*>& lights) :
+	lights(lights) {
+}
+
+void RgbLightSink::write(size_t first, size_t count, const uint8_t* r,
+		const uint8_t* g, const uint8_t* b) {
+	for (size_t i = first; i < first + count && i < lights.size(); i++) {
+		LightSetting value{r[i], g[i], b[i]};
+		if (lights[i]->get() != value)
+			lights[i]->set(value);
+	}
+}
+
+ByteSink::ByteSink(const std::string& path, size_t pixels) :
+	fd(open(path.c_str(), O_WRONLY | O_CLOEXEC)),
+	frame(3 * pixels, 0) {
+
+	struct stat status;
+	if (fd == -1 || fstat(fd, &status) != 0) {
+		if (fd != -1)
+			close(fd);
+		throw std::runtime_error("cannot open pixel sink " + path);
+	}
+	seekable = S_ISREG(status.st_mode) || S_ISBLK(status.st_mode);
+}
+
+ByteSink::~ByteSink() {
+	close(fd);
+}
+
+void ByteSink::write(size_t first, size_t count, const uint8_t* r,
+		const uint8_t* g, const uint8_t* b) {
+	size_t pixels = frame.size() / 3;
+	if (first > pixels || count > pixels - first) {
+		printf("ERROR: pixels %zu..%zu beyond a frame of %zu.\n", first,
+				first + count - 1, pixels);
+		return;
+	}
+
+	for (size_t i = first; i < first + count; i++) {
+		frame[3 * i] = r[i];
+		frame[3 * i + 1] = g[i];
+		frame[3 * i + 2] = b[i];
+	}
+
+	ssize_t len;
+	ssize_t written;
+	if (seekable) {
+		len = 3 * count;
+		written = pwrite(fd, frame.data() + 3 * first, len, 3 * first);
+	} else {
+		len = frame.size();
+		written = ::write(fd, frame.data(), len);
+	}
+	if (written != len)
+		printf("ERROR while writing %zd pixel bytes.\n", len);
+}
+
+} // namespace pixels
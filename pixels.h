@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+namespace pixels {
+
+/**
+ * Receives the pixels first..first+count-1 of a PixelStrip that changed.
+ * Channels are separate arrays (r, g, b) indexed by pixel.
+ */
+class PixelSink {
+public:
+	virtual ~PixelSink() {}
+	virtual void write(size_t first, size_t count, const uint8_t* r,
+			const uint8_t* g, const uint8_t* b) = 0;
+};
+
+/**
+ * Framebuffer of N RGB pixels, e.g. one per job. Pixels are drawn into a
+ * back buffer and flushed to a sink; the front buffer holds what the sink
+ * shows. Both are structure-of-arrays in one allocation, and only the range
+ * of pixels that differ between them is flushed.
+ */
+class PixelStrip {
+public:
+	struct Stats {
+		size_t flushes{0};
+		size_t pixelsWritten{0};
+	};
+
+	PixelStrip(size_t pixels, PixelSink& sink);
+
+	size_t size() const;
+
+	/**
+	 * Pixels beyond the strip are ignored.
+	 */
+	void set(size_t pixel, common::LightSetting value);
+	common::LightSetting get(size_t pixel) const; // as drawn
+	void fill(common::LightSetting value);
+
+	/**
+	 * Writes the dirty range to the sink. Returns false if nothing changed.
+	 */
+	bool flush();
+
+	Stats getStats() const;
+
+private:
+	enum Buffer {
+		FRONT,
+		BACK
+	};
+
+	uint8_t* channel(Buffer buffer, int channel);
+	const uint8_t* channel(Buffer buffer, int channel) const;
+	bool differs(size_t pixel) const;
+
+	size_t pixels;
+	PixelSink& sink;
+	std::vector<uint8_t> buffers; // [FRONT r g b][BACK r g b]
+	size_t dirtyFirst;
+	size_t dirtyEnd{0};
+	Stats stats;
+};
+
+/**
+ * Shows each pixel on its own RgbLight, e.g. a PwmRgbLed on a PwmOutput
+ * triplet. Lights are only set when their pixel changed.
+ */
+class RgbLightSink : public PixelSink {
+public:
+	RgbLightSink(const std::vector<common::RgbLight*>& lights);
+
+	void write(size_t first, size_t count, const uint8_t* r,
+			const uint8_t* g, const uint8_t* b) override;
+
+private:
+	std::vector<common::RgbLight*> lights;
+};
+
+/**
+ * Streams pixels as interleaved RGB bytes, like an SPI LED strip, to a file,
+ * FIFO or device. Seekable targets get only the changed bytes at their
+ * offset; others get the whole frame every time, as a shift register chain
+ * has to be clocked out completely. Writes beyond the frame of the given
+ * number of pixels are rejected.
+ */
+class ByteSink : public PixelSink {
+public:
+	ByteSink(const std::string& path, size_t pixels);
+	~ByteSink();
+
+	ByteSink(const ByteSink&) = delete;
+	ByteSink& operator=(const ByteSink&) = delete;
+
+	void write(size_t first, size_t count, const uint8_t* r,
+			const uint8_t* g, const uint8_t* b) override;
+
+private:
+	int fd;
+	bool seekable;
+	std::vector<uint8_t> frame; // interleaved
+};
+
+} // namespace pixels
@@ -1,41 +1,90 @@
 #include "pwm.h"
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
 namespace pwm {
 
+constexpr std::chrono::milliseconds LinuxPwmOutput::EXPORT_SETTLE_TIME;
+
+constexpr double LinearCalibration::GAMMA;
+constexpr double LinearCalibration::GAIN_RED;
+constexpr double LinearCalibration::GAIN_GREEN;
+constexpr double LinearCalibration::GAIN_BLUE;
+constexpr double GammaCalibration::GAMMA;
+constexpr double GammaCalibration::GAIN_RED;
+constexpr double GammaCalibration::GAIN_GREEN;
+constexpr double GammaCalibration::GAIN_BLUE;
+
 LinuxPwmOutput::LinuxPwmOutput(const std::string& basePath, unsigned int pwmchip, unsigned int pwm) :
 	basePath(basePath),
 	pwmchip(pwmchip),
 	pwm(pwm) {
 
-	exportPwm();
-	setProperty("enable", "0");
-	setProperty("period", "0");
-	setProperty("duty_cycle", "0");
+	bool exported = exportPwm();
+
+	static const char* const names[PROPERTY_COUNT] = {
+		"period", "duty_cycle", "enable"
+	};
+	auto pwmPath = basePath + std::string("/pwmchip") +
+		std::to_string(pwmchip) + std::string("/pwm") +
+		std::to_string(pwm) + std::string("/");
+	// The attributes of a newly exported channel may show up, or become
+	// writable (udev), only a moment after the export.
+	auto deadline = std::chrono::steady_clock::now() + EXPORT_SETTLE_TIME;
+	for (int i = 0; i < PROPERTY_COUNT; i++) {
+		propertyPaths[i] = pwmPath + names[i];
+		while ((propertyFds[i] = open(propertyPaths[i].c_str(), O_WRONLY | O_CLOEXEC)) == -1 &&
+				exported && (errno == ENOENT || errno == EACCES) &&
+				std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (propertyFds[i] == -1)
+			printf("ERROR while opening property %s.\n", propertyPaths[i].c_str());
+	}
+
+	setProperty(ENABLE, 0);
+	setProperty(PERIOD, 0);
+	setProperty(DUTY_CYCLE, 0);
+}
+
+LinuxPwmOutput::~LinuxPwmOutput() {
+	for (int fd : propertyFds) {
+		if (fd != -1)
+			close(fd);
+	}
 }
 
 void LinuxPwmOutput::enable(bool en) {
-	if (en)
-		setProperty("enable", "1");
-	else
-		setProperty("enable", "0");
+	setProperty(ENABLE, en ? 1 : 0);
 }
 
 void LinuxPwmOutput::setPeriodNs(unsigned long int value) {
-	setProperty("period", std::to_string(value));
+	setProperty(PERIOD, value);
 }
 
 void LinuxPwmOutput::setDutyCycleNs(unsigned long int value) {
-	setProperty("duty_cycle", std::to_string(value));
+	setProperty(DUTY_CYCLE, value);
 }
 
-void LinuxPwmOutput::exportPwm() {
+void LinuxPwmOutput::resync() {
+	// All attributes are set on construction.
+	for (int i = 0; i < PROPERTY_COUNT; i++)
+		writeProperty(static_cast<Property>(i), shadow[i]);
+}
+
+LinuxPwmOutput::Stats LinuxPwmOutput::getStats() const {
+	return stats;
+}
+
+bool LinuxPwmOutput::exportPwm() {
 	auto exportPath = basePath + std::string("/pwmchip") +
 		std::to_string(pwmchip) + std::string("/export");
 
 	int fd = open(exportPath.c_str(), O_WRONLY);
 	if (fd == -1) {
 		printf("ERROR while exporting %s.\n", exportPath.c_str());
-		return;
+		return false;
 	}
 
 	auto pwmString = (std::to_string(pwm));
@@ -43,30 +92,160 @@ void LinuxPwmOutput::exportPwm() {
 	if (bytesWritten != pwmString.size()) {
 		printf("ERROR while exporting %s.\n", pwmString.c_str());
 		close(fd);
-		return;
+		return false;
 	}
 
 	close(fd);
+	return true;
 }
 
-void LinuxPwmOutput::setProperty(const std::string& prop, const std::string& value) {
-	auto propertyPath = basePath + std::string("/pwmchip") +
-		std::to_string(pwmchip) + std::string("/pwm") + 
-		std::to_string(pwm) + std::string("/") + prop;
-	int fd = open(propertyPath.c_str(), O_WRONLY);
-	if (fd == -1) {
-		printf("ERROR while opening property %s.\n", propertyPath.c_str());
+void LinuxPwmOutput::setProperty(Property prop, unsigned long value) {
+	if (shadowValid[prop] && shadow[prop] == value) {
+		stats.elided++;
 		return;
 	}
+	writeProperty(prop, value);
+}
 
-	size_t bytesWritten = write(fd, value.c_str(), value.size());
-	if (bytesWritten != value.size()) {
-		printf("ERROR while opening property %s.\n", propertyPath.c_str());
-		close(fd);
+void LinuxPwmOutput::writeProperty(Property prop, unsigned long value) {
+	shadow[prop] = value;
+	shadowValid[prop] = false;
+	int fd = propertyFds[prop];
+	if (fd == -1)
+		return;
+
+	char buffer[24];
+	char* end = buffer + sizeof(buffer);
+	char* begin = end;
+	*--begin = '\n';
+	do {
+		*--begin = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	ssize_t len = end - begin;
+	if (pwrite(fd, begin, len, 0) != len) {
+		printf("ERROR while writing property %s.\n", propertyPaths[prop].c_str());
 		return;
 	}
+	shadowValid[prop] = true;
+	stats.written++;
+}
 
-	close(fd);
+PwmWorker::PwmWorker() :
+	thread(&PwmWorker::run, this) {
+}
+
+PwmWorker::~PwmWorker() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_one();
+	thread.join();
+}
+
+void PwmWorker::flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t target = submittedCount;
+	written.wait(lock, [&]() { return writtenCount >= target; });
+}
+
+PwmWorker::Stats PwmWorker::getStats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	Stats stats;
+	stats.submitted = submittedCount;
+	stats.merged = mergedCount;
+	return stats;
+}
+
+void PwmWorker::submit(AsyncPwmOutput& output, int attribute, unsigned long value) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		unsigned bit = 1u << attribute;
+		if (output.pendingMask == 0)
+			dirty.push_back(&output);
+		else if (output.pendingMask & bit)
+			mergedCount++;
+		output.pending[attribute] = value;
+		output.pendingMask |= bit;
+		submittedCount++;
+	}
+	wakeup.notify_one();
+}
+
+void PwmWorker::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (1) {
+		wakeup.wait(lock, [&]() { return stopping || !dirty.empty(); });
+		if (dirty.empty())
+			return; // stopping
+
+		batches.clear();
+		for (AsyncPwmOutput* output : dirty) {
+			Batch batch{output, {}, output->pendingMask, false};
+			for (int i = 0; i < AsyncPwmOutput::ATTRIBUTE_COUNT; i++)
+				batch.values[i] = output->pending[i];
+			batch.dimming = (batch.mask & (1u << AsyncPwmOutput::DUTY_CYCLE)) &&
+				batch.values[AsyncPwmOutput::DUTY_CYCLE] < output->writtenDutyCycle;
+			output->pendingMask = 0;
+			batches.push_back(batch);
+		}
+		dirty.clear();
+		uint64_t target = submittedCount;
+
+		lock.unlock();
+		for (bool dimming : {true, false}) {
+			for (auto& batch : batches) {
+				if (batch.dimming == dimming)
+					batch.output->write(batch.values, batch.mask);
+			}
+		}
+		lock.lock();
+
+		writtenCount = target;
+		written.notify_all();
+	}
+}
+
+AsyncPwmOutput::AsyncPwmOutput(PwmOutput& output, PwmWorker& worker) :
+	output(output),
+	worker(worker) {
+}
+
+AsyncPwmOutput::~AsyncPwmOutput() {
+	flush();
+}
+
+void AsyncPwmOutput::enable(bool en) {
+	worker.submit(*this, ENABLE, en ? 1 : 0);
+}
+
+void AsyncPwmOutput::setPeriodNs(unsigned long int value) {
+	worker.submit(*this, PERIOD, value);
+}
+
+void AsyncPwmOutput::setDutyCycleNs(unsigned long int value) {
+	worker.submit(*this, DUTY_CYCLE, value);
+}
+
+void AsyncPwmOutput::flush() {
+	worker.flush();
+}
+
+void AsyncPwmOutput::write(const unsigned long* values, unsigned mask) {
+	bool dutyCycleFirst = (mask & (1u << PERIOD)) &&
+		values[PERIOD] < writtenDutyCycle;
+	if ((mask & (1u << DUTY_CYCLE)) && dutyCycleFirst)
+		output.setDutyCycleNs(values[DUTY_CYCLE]);
+	if (mask & (1u << PERIOD))
+		output.setPeriodNs(values[PERIOD]);
+	if ((mask & (1u << DUTY_CYCLE)) && !dutyCycleFirst)
+		output.setDutyCycleNs(values[DUTY_CYCLE]);
+	if (mask & (1u << DUTY_CYCLE))
+		writtenDutyCycle = values[DUTY_CYCLE];
+	if (mask & (1u << ENABLE))
+		output.enable(values[ENABLE] != 0);
 }
 
 PwmBeeper::PwmBeeper(PwmOutput& pwmOutput, SleepFunction sleepFunction) :
@@ -98,41 +277,161 @@ void PwmBeeper::playTone(const common::BeeperTone& tone) {
 	pwmOutput.enable(false);
 }
 
-PwmRgbLed::PwmRgbLed(PwmOutput& pwmRed, PwmOutput& pwmGreen, PwmOutput& pwmBlue) :
-	pwmRed(pwmRed),
-	pwmGreen(pwmGreen),
-	pwmBlue(pwmBlue) {
+ToneSequencer::ToneSequencer(PwmOutput& pwmOutput) :
+	pwmOutput(pwmOutput),
+	timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)),
+	eventFd(eventfd(0, EFD_CLOEXEC)) {
 
-	setChannelDefaults(pwmRed);
-	setChannelDefaults(pwmGreen);
-	setChannelDefaults(pwmBlue);
+	if (timerFd < 0 || eventFd < 0) {
+		close(timerFd);
+		close(eventFd);
+		throw std::runtime_error("creating timerfd or eventfd failed");
+	}
+	silence();
+	thread = std::thread(&ToneSequencer::run, this);
 }
 
-unsigned long PwmRgbLed::getDefaultPeriodNs() {
-	return 70000UL; // 14 kHz
+ToneSequencer::~ToneSequencer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	uint64_t one = 1;
+	if (write(eventFd, &one, sizeof(one)) != sizeof(one))
+		printf("ERROR while stopping the tone sequencer.\n");
+	thread.join();
+	close(timerFd);
+	close(eventFd);
 }
 
-void PwmRgbLed::set(common::LightSetting value) {
-	bufferedSetting = value;
-	setChannel(pwmRed, value.r);
-	setChannel(pwmGreen, value.g);
-	setChannel(pwmBlue, value.b);
+void ToneSequencer::setVolume(uint8_t volume) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->volume = (volume <= 100) ? volume : 100;
 }
 
-common::LightSetting PwmRgbLed::get() {
-	return bufferedSetting;
+uint8_t ToneSequencer::getVolume() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return volume;
 }
 
-void PwmRgbLed::setChannel(PwmOutput& pwmOutput, unsigned long value) {
-	pwmOutput.setPeriodNs(getDefaultPeriodNs());
-	pwmOutput.setDutyCycleNs(getDefaultPeriodNs() * DUTY_CYCLE_MAX_RATIO * value / 255);
-	pwmOutput.enable(true);
+void ToneSequencer::playTone(const common::BeeperTone& tone) {
+	play({tone});
 }
 
-void PwmRgbLed::setChannelDefaults(PwmOutput& pwmOutput) {
-	pwmOutput.setPeriodNs(getDefaultPeriodNs());
-	pwmOutput.setDutyCycleNs(0);
+void ToneSequencer::play(const std::vector<common::BeeperTone>& sequence) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		next = sequence;
+		nextPending = true;
+		playing = true;
+	}
+	uint64_t one = 1;
+	if (write(eventFd, &one, sizeof(one)) != sizeof(one))
+		printf("ERROR while queueing tones.\n");
+}
+
+void ToneSequencer::waitIdle() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [&]() { return !playing; });
+}
+
+ToneSequencer::Stats ToneSequencer::getStats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void ToneSequencer::run() {
+	struct pollfd fds[2] = {
+		{eventFd, POLLIN, 0},
+		{timerFd, POLLIN, 0}
+	};
+	while (1) {
+		if (::poll(fds, 2, -1) < 0)
+			continue; // EINTR
+
+		bool changed = false;
+		uint64_t count;
+		if ((fds[1].revents & POLLIN) &&
+				read(timerFd, &count, sizeof(count)) == sizeof(count)) {
+			auto jitter = Clock::now() - deadline;
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.deadlines++;
+			stats.totalJitter += jitter;
+			if (jitter > stats.maxJitter)
+				stats.maxJitter = jitter;
+			position++;
+			changed = true;
+		}
+
+		if ((fds[0].revents & POLLIN) &&
+				read(eventFd, &count, sizeof(count)) == sizeof(count)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				break;
+			if (nextPending) {
+				if (position < sequence.size())
+					stats.preempted++;
+				stats.sequences++;
+				sequence.swap(next);
+				nextPending = false;
+				position = 0;
+				deadline = Clock::now();
+				changed = true;
+			}
+		}
+
+		if (!changed)
+			continue;
+		if (position < sequence.size()) {
+			startTone();
+			continue;
+		}
+
+		silence();
+		struct itimerspec disarm{};
+		timerfd_settime(timerFd, 0, &disarm, nullptr);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!nextPending) {
+			playing = false;
+			idle.notify_all();
+		}
+	}
+	silence();
+}
+
+void ToneSequencer::startTone() {
+	const common::BeeperTone& tone = sequence[position];
+	uint8_t volume;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		volume = this->volume;
+	}
+
+	if (tone.frequency_hz) {
+		// No duty cycle beyond the period in between (sysfs rejects it).
+		auto period = common::GIGA / tone.frequency_hz;
+		pwmOutput.setDutyCycleNs(0);
+		pwmOutput.setPeriodNs(period);
+		pwmOutput.setDutyCycleNs(period * volume / 100);
+		pwmOutput.enable(true);
+	} else {
+		pwmOutput.enable(false);
+	}
+
+	deadline += std::chrono::milliseconds(tone.duration_ms);
+	auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			deadline.time_since_epoch()).count();
+	struct itimerspec timer{};
+	timer.it_value.tv_sec = sinceEpoch / common::GIGA;
+	timer.it_value.tv_nsec = sinceEpoch % common::GIGA;
+	if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+		timer.it_value.tv_nsec = 1; // zero would disarm
+	timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, nullptr);
+}
+
+void ToneSequencer::silence() {
 	pwmOutput.enable(false);
+	pwmOutput.setDutyCycleNs(0);
 }
 
 }
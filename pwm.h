@@ -1,7 +1,9 @@
 #pragma once
 
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <sstream>
 #include <exception>
@@ -12,6 +14,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 #include "common.h"
 
@@ -26,21 +32,157 @@ public:
 	virtual void setDutyCycleNs(unsigned long int value) = 0;
 };
 
+/**
+ * PWM channel of the Linux sysfs interface. The attribute files are opened
+ * once and kept open, so every update is a single pwrite() of a number
+ * formatted on the stack. Values are written with a trailing newline, which
+ * sysfs accepts and which ends them in plain files (see the tests).
+ *
+ * The last value set for each attribute is shadowed, and writes that would
+ * not change it are elided. After a failed write, the next one is not.
+ */
 class LinuxPwmOutput : public PwmOutput {
 public:
+	struct Stats {
+		size_t written{0};
+		size_t elided{0};
+	};
+
 	LinuxPwmOutput(const std::string& basePath, unsigned int pwmchip, unsigned int pwm);
+	~LinuxPwmOutput();
+
+	LinuxPwmOutput(const LinuxPwmOutput&) = delete;
+	LinuxPwmOutput& operator=(const LinuxPwmOutput&) = delete;
+
 	void enable(bool en) override;
 	void setPeriodNs(unsigned long int value) override;
 	void setDutyCycleNs(unsigned long int value) override;
 
+	/**
+	 * Writes the shadowed values again, for when the hardware state may have
+	 * drifted (e.g. another process used the channel, or writes failed).
+	 */
+	void resync();
+
+	Stats getStats() const;
+
 private:
-	void exportPwm();
-	void setProperty(const std::string& prop, const std::string& value);
+	enum Property {
+		PERIOD,
+		DUTY_CYCLE,
+		ENABLE,
+		PROPERTY_COUNT
+	};
+
+	static constexpr std::chrono::milliseconds EXPORT_SETTLE_TIME{500};
+
+	bool exportPwm();
+	void setProperty(Property prop, unsigned long value);
+	void writeProperty(Property prop, unsigned long value);
 
 private:
 	std::string basePath;
 	unsigned int pwmchip;
 	unsigned int pwm;
+	std::string propertyPaths[PROPERTY_COUNT];
+	int propertyFds[PROPERTY_COUNT];
+	unsigned long shadow[PROPERTY_COUNT];
+	bool shadowValid[PROPERTY_COUNT]{};
+	Stats stats;
+};
+
+class AsyncPwmOutput;
+
+/**
+ * Worker thread applying the updates of AsyncPwmOutputs. One worker may
+ * serve several outputs; it drains pending updates in batches, so updates
+ * that arrive while it writes are merged. Within a batch, outputs whose duty
+ * cycle decreases are written first, as by BasicPwmRgbLed::commit(), since
+ * merging may have reordered the updates of a colour change.
+ */
+class PwmWorker {
+public:
+	struct Stats {
+		size_t submitted{0};
+		size_t merged{0}; // superseded before being written
+	};
+
+	PwmWorker();
+	~PwmWorker(); // applies what is pending, then stops
+
+	PwmWorker(const PwmWorker&) = delete;
+	PwmWorker& operator=(const PwmWorker&) = delete;
+
+	/**
+	 * Barrier: returns once everything submitted before is written.
+	 */
+	void flush();
+
+	Stats getStats();
+
+private:
+	friend class AsyncPwmOutput;
+
+	struct Batch {
+		AsyncPwmOutput* output;
+		unsigned long values[3]; // by AsyncPwmOutput::Attribute
+		unsigned mask;
+		bool dimming;
+	};
+
+	void submit(AsyncPwmOutput& output, int attribute, unsigned long value);
+	void run();
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable written;
+	std::vector<AsyncPwmOutput*> dirty;
+	std::vector<Batch> batches; // worker thread only
+	uint64_t submittedCount{0};
+	uint64_t writtenCount{0};
+	size_t mergedCount{0};
+	bool stopping{false};
+	std::thread thread;
+};
+
+/**
+ * Write-behind decorator: updates only take a short lock on the caller's
+ * thread and are written to the decorated output by a PwmWorker. An update
+ * still pending when the same attribute is set again is superseded.
+ *
+ * Updates pending together are written in the order period, duty cycle,
+ * enable, but the duty cycle first if the period shrinks below it (sysfs
+ * rejects a duty cycle beyond the period). Not meant for the beeper, whose
+ * timing is up to its caller.
+ */
+class AsyncPwmOutput : public PwmOutput {
+public:
+	AsyncPwmOutput(PwmOutput& output, PwmWorker& worker);
+	~AsyncPwmOutput(); // flushes
+
+	void enable(bool en) override;
+	void setPeriodNs(unsigned long int value) override;
+	void setDutyCycleNs(unsigned long int value) override;
+
+	void flush();
+
+private:
+	friend class PwmWorker;
+
+	enum Attribute {
+		PERIOD,
+		DUTY_CYCLE,
+		ENABLE,
+		ATTRIBUTE_COUNT
+	};
+
+	void write(const unsigned long* values, unsigned mask);
+
+	PwmOutput& output;
+	PwmWorker& worker;
+	unsigned long pending[ATTRIBUTE_COUNT]; // guarded by the worker's mutex
+	unsigned pendingMask{0};
+	unsigned long writtenDutyCycle{0}; // worker thread only
 };
 
 class PwmBeeper : public common::Beeper {
@@ -58,9 +200,207 @@ private:
 	uint8_t volume{50};
 };
 
-class PwmRgbLed : public common::RgbLight {
+/**
+ * Plays sequences of tones (frequency 0 is a rest) from its own thread,
+ * timed by an absolute timerfd deadline per tone, so the caller never
+ * blocks and the timing does not drift over a sequence. A new sequence
+ * preempts the one playing; an empty one silences the beeper.
+ *
+ * Jitter is how late the thread woke up for each deadline.
+ */
+class ToneSequencer : public common::Beeper {
+public:
+	using Clock = std::chrono::steady_clock; // CLOCK_MONOTONIC
+
+	struct Stats {
+		size_t sequences{0};
+		size_t preempted{0};
+		size_t deadlines{0};
+		Clock::duration maxJitter{0};
+		Clock::duration totalJitter{0};
+	};
+
+	ToneSequencer(PwmOutput& pwmOutput);
+	~ToneSequencer();
+
+	ToneSequencer(const ToneSequencer&) = delete;
+	ToneSequencer& operator=(const ToneSequencer&) = delete;
+
+	void setVolume(uint8_t volume) override;
+	uint8_t getVolume() override;
+
+	/**
+	 * Plays the tone without waiting for it, preempting the current sequence.
+	 */
+	void playTone(const common::BeeperTone& tone) override;
+	void play(const std::vector<common::BeeperTone>& sequence);
+
+	/**
+	 * Waits until nothing is playing any more.
+	 */
+	void waitIdle();
+
+	Stats getStats();
+
+private:
+	void run();
+	void startTone();
+	void silence();
+
+	PwmOutput& pwmOutput;
+	int timerFd;
+	int eventFd;
+
+	std::mutex mutex;
+	std::condition_variable idle;
+	std::vector<common::BeeperTone> next;
+	bool nextPending{false};
+	bool playing{false};
+	bool stopping{false};
+	uint8_t volume{50};
+	Stats stats;
+
+	// Thread only.
+	std::vector<common::BeeperTone> sequence;
+	size_t position{0};
+	Clock::time_point deadline;
+
+	std::thread thread;
+};
+
+/**
+ * Duty cycle calibrations for BasicPwmRgbLed. The channel value, normalized
+ * to 0..1, is raised to GAMMA (1 for linear output) and scaled by the gain
+ * of its channel, which balances the LEDs against each other.
+ */
+struct LinearCalibration {
+	static constexpr double GAMMA{1.0};
+	static constexpr double GAIN_RED{1.0};
+	static constexpr double GAIN_GREEN{1.0};
+	static constexpr double GAIN_BLUE{1.0};
+};
+
+/**
+ * Perceptually even steps, so that fades look smooth. The gains are
+ * placeholders until the LEDs of the device have been measured.
+ */
+struct GammaCalibration {
+	static constexpr double GAMMA{2.2};
+	static constexpr double GAIN_RED{1.0};
+	static constexpr double GAIN_GREEN{1.0};
+	static constexpr double GAIN_BLUE{1.0};
+};
+
+/**
+ * Duty cycles in ns by channel (r, g, b) and channel value.
+ */
+struct DutyCycleTable {
+	unsigned long ns[3][256];
+};
+
+namespace detail {
+
+// <cmath> is not constexpr; these are accurate enough for 8-bit tables.
+
+constexpr double ln(double x) {
+	int exponent = 0;
+	while (x < 0.5) {
+		x *= 2;
+		exponent--;
+	}
+	while (x >= 1) {
+		x /= 2;
+		exponent++;
+	}
+	// ln(x) = 2 atanh(z), with |z| <= 1/3 here
+	double z = (x - 1) / (x + 1);
+	double term = z;
+	double sum = 0;
+	for (int n = 1; n < 40; n += 2) {
+		sum += term / n;
+		term *= z * z;
+	}
+	return 2 * sum + exponent * 0.693147180559945309417;
+}
+
+constexpr double exp(double y) {
+	int halvings = 0;
+	while (y < -0.5 || y > 0.5) {
+		y /= 2;
+		halvings++;
+	}
+	double term = 1;
+	double sum = 1;
+	for (int n = 1; n < 20; n++) {
+		term *= y / n;
+		sum += term;
+	}
+	while (halvings-- > 0)
+		sum *= sum;
+	return sum;
+}
+
+constexpr double power(double x, double exponent) {
+	return (x == 0 || exponent == 1) ? x : exp(exponent * ln(x));
+}
+
+} // namespace detail
+
+template<typename Calibration>
+constexpr DutyCycleTable makeDutyCycleTable(unsigned long periodNs,
+		double maxRatio) {
+	DutyCycleTable table{};
+	const double gains[3] = {
+		Calibration::GAIN_RED, Calibration::GAIN_GREEN, Calibration::GAIN_BLUE
+	};
+	for (int channel = 0; channel < 3; channel++) {
+		for (int value = 0; value < 256; value++) {
+			table.ns[channel][value] = periodNs * maxRatio * gains[channel] *
+				detail::power(value / 255.0, Calibration::GAMMA);
+		}
+	}
+	return table;
+}
+
+/**
+ * RGB LED on three PWM channels. The duty cycle of every channel value is
+ * looked up in a table generated at compile time from the Calibration.
+ *
+ * A colour change is a transaction: stage() it, then commit() it. Period
+ * and enable of all channels are written before any duty cycle, so that a
+ * commit ends in the duty cycles that change, back to back. Channels that
+ * dim are written before those that brighten, so the mixed state in between
+ * is darker than either colour rather than a third one (red to green passes
+ * through dark red, not yellow).
+ *
+ * On AsyncPwmOutputs a commit only queues the writes, and the settle times
+ * in Stats are those of queuing. The PwmWorker keeps dimming channels first,
+ * but may split a commit across two batches.
+ */
+template<typename Calibration = LinearCalibration>
+class BasicPwmRgbLed : public common::RgbLight {
 public:
-	PwmRgbLed(PwmOutput& pwmRed, PwmOutput& pwmGreen, PwmOutput& pwmBlue);
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats {
+		size_t commits{0};
+		size_t settledCommits{0}; // commits that wrote a duty cycle
+		size_t dutyCyclesWritten{0};
+		// From the first duty cycle write of a commit until the last returned.
+		std::chrono::nanoseconds lastSettleTime{0};
+		std::chrono::nanoseconds maxSettleTime{0};
+		std::chrono::nanoseconds totalSettleTime{0};
+	};
+
+	BasicPwmRgbLed(PwmOutput& pwmRed, PwmOutput& pwmGreen, PwmOutput& pwmBlue) :
+		pwmRed(pwmRed),
+		pwmGreen(pwmGreen),
+		pwmBlue(pwmBlue) {
+
+		setChannelDefaults(pwmRed);
+		setChannelDefaults(pwmGreen);
+		setChannelDefaults(pwmBlue);
+	}
 
 	/**
 	 * This maximum is due to wrong hardware dimensioning (LEDs get too hot).
@@ -71,19 +411,104 @@ public:
 	 * For LEDs the period may remain constant.
 	 * It is fine-tuned in order to avoid audible crosstalk effects.
 	 */
-	unsigned long getDefaultPeriodNs();
-	void set(common::LightSetting value);
-	common::LightSetting get();
+	static constexpr unsigned long DEFAULT_PERIOD_NS{70000UL}; // 14 kHz
+
+	static constexpr DutyCycleTable DUTY_CYCLES{
+		makeDutyCycleTable<Calibration>(DEFAULT_PERIOD_NS, DUTY_CYCLE_MAX_RATIO)};
+
+	unsigned long getDefaultPeriodNs() {
+		return DEFAULT_PERIOD_NS;
+	}
+
+	void set(common::LightSetting value) {
+		stage(value);
+		commit();
+	}
+
+	common::LightSetting get() {
+		return bufferedSetting;
+	}
+
+	/**
+	 * Stages a colour for the next commit(); nothing is written yet.
+	 */
+	void stage(common::LightSetting value) {
+		stagedSetting = value;
+	}
+
+	void commit() {
+		PwmOutput* outputs[3] = {&pwmRed, &pwmGreen, &pwmBlue};
+		if (!enabled) {
+			for (auto output : outputs)
+				output->setPeriodNs(DEFAULT_PERIOD_NS);
+			for (auto output : outputs)
+				output->enable(true);
+			enabled = true;
+		}
+
+		const unsigned long dutyCycles[3] = {
+			DUTY_CYCLES.ns[0][stagedSetting.r],
+			DUTY_CYCLES.ns[1][stagedSetting.g],
+			DUTY_CYCLES.ns[2][stagedSetting.b]
+		};
+		int order[3];
+		int count = 0;
+		for (bool dimming : {true, false}) {
+			for (int channel = 0; channel < 3; channel++) {
+				if (dutyCycles[channel] != writtenDutyCycles[channel] &&
+						(dutyCycles[channel] < writtenDutyCycles[channel]) == dimming)
+					order[count++] = channel;
+			}
+		}
+
+		auto start = Clock::now();
+		for (int i = 0; i < count; i++) {
+			outputs[order[i]]->setDutyCycleNs(dutyCycles[order[i]]);
+			writtenDutyCycles[order[i]] = dutyCycles[order[i]];
+		}
+		auto settleTime = Clock::now() - start;
+
+		bufferedSetting = stagedSetting;
+		stats.commits++;
+		if (count > 0) {
+			stats.settledCommits++;
+			stats.dutyCyclesWritten += count;
+			stats.lastSettleTime = settleTime;
+			if (settleTime > stats.maxSettleTime)
+				stats.maxSettleTime = settleTime;
+			stats.totalSettleTime += settleTime;
+		}
+	}
+
+	Stats getStats() const {
+		return stats;
+	}
 
 private:
-	void setChannel(PwmOutput& pwmOutput, unsigned long value);
-	void setChannelDefaults(PwmOutput& pwmOutput);
+	void setChannelDefaults(PwmOutput& pwmOutput) {
+		pwmOutput.setPeriodNs(DEFAULT_PERIOD_NS);
+		pwmOutput.setDutyCycleNs(0);
+		pwmOutput.enable(false);
+	}
 
 private:
 	common::LightSetting bufferedSetting;
+	common::LightSetting stagedSetting;
 	PwmOutput& pwmRed;
 	PwmOutput& pwmGreen;
 	PwmOutput& pwmBlue;
+	unsigned long writtenDutyCycles[3]{};
+	bool enabled{false};
+	Stats stats;
 };
 
+template<typename Calibration>
+constexpr double BasicPwmRgbLed<Calibration>::DUTY_CYCLE_MAX_RATIO;
+template<typename Calibration>
+constexpr unsigned long BasicPwmRgbLed<Calibration>::DEFAULT_PERIOD_NS;
+template<typename Calibration>
+constexpr DutyCycleTable BasicPwmRgbLed<Calibration>::DUTY_CYCLES;
+
+using PwmRgbLed = BasicPwmRgbLed<>;
+
 } // namespace pwm
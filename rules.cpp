@@ -0,0 +1,293 @@
+#include "rules.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+namespace rules {
+
+using common::BuildResult;
+using common::StringView;
+
+const uint32_t RuleEngine::NO_RULE;
+const uint32_t RuleEngine::MATCH_FLAG;
+
+RuleEngine::RuleEngine(const std::vector<Rule>& rules) {
+	for (auto& c : byteClass)
+		c = 0;
+	for (auto& rule : rules) {
+		if (rule.pattern.empty())
+			throw std::invalid_argument("empty rule pattern");
+		for (unsigned char c : rule.pattern) {
+			if (byteClass[c] == 0)
+				byteClass[c] = classCount++;
+		}
+	}
+
+	// Trie of all patterns; missing edges are 0, which is never a child.
+	std::vector<uint32_t> trie(classCount, 0);
+	matches.push_back(NO_RULE);
+	for (size_t i = 0; i < rules.size(); i++) {
+		uint32_t state = 0;
+		for (unsigned char c : rules[i].pattern) {
+			uint32_t& next = trie[state * classCount + byteClass[c]];
+			if (next == 0) {
+				next = matches.size();
+				matches.push_back(NO_RULE);
+				trie.resize(trie.size() + classCount, 0);
+			}
+			state = trie[state * classCount + byteClass[c]];
+		}
+		if (matches[state] == NO_RULE)
+			matches[state] = i;
+		results.push_back(rules[i].result);
+	}
+
+	// Breadth-first over the trie: complete the transitions along the
+	// failure links and inherit the matches of the longest proper suffix.
+	transitions = trie;
+	std::vector<uint32_t> failure(matches.size(), 0);
+	std::deque<uint32_t> queue;
+	for (size_t c = 0; c < classCount; c++) {
+		if (trie[c] != 0)
+			queue.push_back(trie[c]);
+	}
+	while (!queue.empty()) {
+		uint32_t state = queue.front();
+		queue.pop_front();
+		matches[state] = std::min(matches[state], matches[failure[state]]);
+
+		for (size_t c = 0; c < classCount; c++) {
+			uint32_t child = trie[state * classCount + c];
+			uint32_t fallback = transitions[failure[state] * classCount + c];
+			if (child != 0) {
+				failure[child] = fallback;
+				queue.push_back(child);
+			} else {
+				transitions[state * classCount + c] = fallback;
+			}
+		}
+	}
+
+	// Store row offsets instead of state numbers, flagging targets with a
+	// match, so that the scan loop neither multiplies nor looks up matches.
+	for (auto& next : transitions) {
+		uint32_t row = next * classCount;
+		next = (matches[next] == NO_RULE) ? row : (row | MATCH_FLAG);
+	}
+}
+
+bool RuleEngine::classify(StringView msg, BuildResult& result) const {
+	const uint32_t* table = transitions.data();
+	uint32_t row = 0;
+	uint32_t best = NO_RULE;
+	for (unsigned char c : msg) {
+		uint32_t next = table[row + byteClass[c]];
+		row = next & ~MATCH_FLAG;
+		if ((next & MATCH_FLAG) && matches[row / classCount] < best) {
+			best = matches[row / classCount];
+			if (best == 0)
+				break; // nothing can take precedence
+		}
+	}
+
+	if (best == NO_RULE)
+		return false;
+	result = results[best];
+	return true;
+}
+
+size_t RuleEngine::getRuleCount() const {
+	return results.size();
+}
+
+size_t RuleEngine::getStateCount() const {
+	return matches.size();
+}
+
+const size_t RuleSet::CACHE_LINE;
+
+RuleSet::RuleSet(const std::vector<Rule>& rules) :
+	current(new RuleEngine(rules)) {
+}
+
+RuleSet::~RuleSet() {
+	delete current.load();
+}
+
+bool RuleSet::classify(StringView msg, BuildResult& result) const {
+	// Sequentially consistent: the count must be visible before the engine
+	// is loaded, see publish().
+	std::atomic<size_t>& readers =
+		readerCounts[phase.load() & 1].readers;
+	readers.fetch_add(1);
+	bool found = current.load()->classify(msg, result);
+	readers.fetch_sub(1, std::memory_order_release);
+	return found;
+}
+
+void RuleSet::publish(std::unique_ptr<const RuleEngine> engine) {
+	std::lock_guard<std::mutex> lock(publishMutex);
+	const RuleEngine* old = current.exchange(engine.release());
+	generation.fetch_add(1, std::memory_order_relaxed);
+
+	// A reader still using the old engine counted itself in before the
+	// exchange. New readers go to the other counter after each flip, so
+	// every wait ends once the readers already in it have left.
+	for (int i = 0; i < 2; i++) {
+		unsigned drained = phase.fetch_add(1) & 1;
+		while (readerCounts[drained].readers.load(std::memory_order_acquire) != 0)
+			std::this_thread::yield();
+	}
+	delete old;
+}
+
+size_t RuleSet::getGeneration() const {
+	return generation.load(std::memory_order_relaxed);
+}
+
+std::vector<Rule> parseRules(std::istream& in) {
+	std::vector<Rule> rules;
+	std::string line;
+	for (size_t lineNo = 1; std::getline(in, line); lineNo++) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line[start] == '#')
+			continue;
+
+		size_t end = line.find_first_of(" \t", start);
+		size_t pattern = (end == std::string::npos) ? end :
+			line.find_first_not_of(" \t", end);
+		std::string result = line.substr(start, end - start);
+		Rule rule;
+		if (result == "OK")
+			rule.result = BuildResult::OK;
+		else if (result == "BROKEN")
+			rule.result = BuildResult::BROKEN;
+		else if (result == "DONTKNOW")
+			rule.result = BuildResult::DONTKNOW;
+		else
+			pattern = std::string::npos;
+		if (pattern == std::string::npos)
+			throw std::runtime_error("malformed rule in line " +
+					std::to_string(lineNo));
+		rule.pattern = line.substr(pattern);
+		rules.push_back(rule);
+	}
+	return rules;
+}
+
+std::vector<Rule> loadRules(const std::string& path) {
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("cannot open " + path);
+	return parseRules(in);
+}
+
+RuleFileReloader::RuleFileReloader(RuleSet& ruleSet, const std::string& path) :
+	ruleSet(ruleSet),
+	path(path) {
+	size_t slash = path.rfind('/');
+	std::string dir = (slash == std::string::npos) ? "." :
+		(slash == 0) ? "/" : path.substr(0, slash);
+	fileName = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signalFd < 0)
+		throw std::runtime_error("signalfd() failed");
+
+	// Without the directory, reloading still works on SIGHUP.
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0 || inotify_add_watch(inotifyFd, dir.c_str(),
+				IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		printf("Not watching %s for rule changes (errno %d).\n", dir.c_str(), errno);
+}
+
+RuleFileReloader::~RuleFileReloader() {
+	close(signalFd);
+	if (inotifyFd >= 0)
+		close(inotifyFd);
+}
+
+bool RuleFileReloader::reload() {
+	std::unique_ptr<const RuleEngine> engine;
+	try {
+		engine.reset(new RuleEngine(loadRules(path)));
+	} catch (const std::exception& e) {
+		printf("Keeping the current rules, %s: %s\n", path.c_str(), e.what());
+		return false;
+	}
+	ruleSet.publish(std::move(engine));
+	return true;
+}
+
+bool RuleFileReloader::poll(int timeout_ms) {
+	struct pollfd fds[2] = {
+		{signalFd, POLLIN, 0},
+		{inotifyFd, POLLIN, 0}
+	};
+	int ready = ::poll(fds, (inotifyFd >= 0) ? 2 : 1, timeout_ms);
+	if (ready <= 0)
+		return false;
+
+	bool changed = false;
+	struct signalfd_siginfo info;
+	while (read(signalFd, &info, sizeof(info)) == sizeof(info))
+		changed = true;
+	if (inotifyFd >= 0 && drainInotify())
+		changed = true;
+	return changed && reload();
+}
+
+void RuleFileReloader::run() {
+	while (1)
+		poll(-1);
+}
+
+void RuleFileReloader::blockReloadSignal() {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+}
+
+bool RuleFileReloader::drainInotify() {
+	alignas(struct inotify_event) char buffer[4096];
+	bool changed = false;
+	ssize_t len;
+	while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + len; ) {
+			auto event = reinterpret_cast<struct inotify_event*>(p);
+			if (event->len > 0 && fileName == event->name)
+				changed = true;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+RuleBuildResultParser::RuleBuildResultParser(const std::vector<Rule>& rules) :
+	engine(rules) {
+}
+
+BuildResult RuleBuildResultParser::parseMsg(StringView msg) {
+	BuildResult result = BuildResult::DONTKNOW;
+	engine.classify(msg, result);
+	return result;
+}
+
+} // namespace rules
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+namespace rules {
+
+/**
+ * Messages containing pattern (case-sensitive) classify as result.
+ */
+struct Rule {
+	std::string pattern;
+	common::BuildResult result;
+};
+
+/**
+ * Aho-Corasick automaton compiled from a set of rules. Classifying a message
+ * takes a single pass with one table lookup per byte, regardless of the
+ * number of rules. If several patterns occur, the rule listed first wins.
+ *
+ * The transition table is over byte classes rather than all 256 byte values:
+ * bytes that occur in no pattern share one class.
+ */
+class RuleEngine {
+public:
+	RuleEngine(const std::vector<Rule>& rules);
+
+	/**
+	 * Returns false if no pattern occurs in msg.
+	 */
+	bool classify(common::StringView msg, common::BuildResult& result) const;
+
+	size_t getRuleCount() const;
+	size_t getStateCount() const;
+
+private:
+	static const uint32_t NO_RULE{UINT32_MAX};
+	static const uint32_t MATCH_FLAG{1u << 31};
+
+	std::vector<common::BuildResult> results; // by rule index
+	uint16_t byteClass[256];
+	size_t classCount{1};
+	std::vector<uint32_t> transitions; // by state * classCount + byte class
+	std::vector<uint32_t> matches;     // first rule matching at state
+};
+
+/**
+ * A RuleEngine that can be replaced while in use, RCU style: publish()
+ * installs a new engine with one atomic exchange, and classify() never takes
+ * a lock or waits for a reload.
+ *
+ * Readers count themselves in on one of two counters. publish() flips the
+ * readers over to the other counter and frees the old engine once both have
+ * drained, so a steady stream of new readers cannot starve it.
+ */
+class RuleSet {
+public:
+	RuleSet(const std::vector<Rule>& rules);
+	~RuleSet();
+
+	RuleSet(const RuleSet&) = delete;
+	RuleSet& operator=(const RuleSet&) = delete;
+
+	bool classify(common::StringView msg, common::BuildResult& result) const;
+
+	/**
+	 * Blocks until no reader uses the previous engine any more, then frees it.
+	 * Concurrent publishers are serialized.
+	 */
+	void publish(std::unique_ptr<const RuleEngine> engine);
+
+	size_t getGeneration() const; // number of engines published
+
+private:
+	static const size_t CACHE_LINE{64};
+
+	struct ReaderCount {
+		std::atomic<size_t> readers{0};
+		char padding[CACHE_LINE - sizeof(std::atomic<size_t>)];
+	};
+
+	std::atomic<const RuleEngine*> current;
+	std::atomic<unsigned> phase{0};
+	mutable ReaderCount readerCounts[2];
+	std::mutex publishMutex;
+	std::atomic<size_t> generation{0};
+};
+
+/**
+ * Reads rules in text form, one per line: the result (OK, BROKEN or
+ * DONTKNOW), blanks, then the pattern up to the end of the line. Empty lines
+ * and lines starting with '#' are skipped. Throws std::runtime_error naming
+ * the first malformed line.
+ */
+std::vector<Rule> parseRules(std::istream& in);
+std::vector<Rule> loadRules(const std::string& path);
+
+/**
+ * Reloads a RuleSet from a rules file when the file is written or replaced
+ * (inotify on its directory, so that editors saving via rename are noticed)
+ * or on SIGHUP. SIGHUP must be blocked in all threads, see blockReloadSignal().
+ * A file that fails to load leaves the published rules in place.
+ */
+class RuleFileReloader {
+public:
+	RuleFileReloader(RuleSet& ruleSet, const std::string& path);
+	~RuleFileReloader();
+
+	RuleFileReloader(const RuleFileReloader&) = delete;
+	RuleFileReloader& operator=(const RuleFileReloader&) = delete;
+
+	/**
+	 * Loads and publishes the file, returns false if it could not be loaded.
+	 */
+	bool reload();
+
+	/**
+	 * Waits up to timeout_ms (-1: forever) for a change and reloads. Returns
+	 * true if new rules were published.
+	 */
+	bool poll(int timeout_ms);
+
+	void run();
+
+	/**
+	 * Blocks SIGHUP in the calling thread and the threads it creates later.
+	 */
+	static void blockReloadSignal();
+
+private:
+	bool drainInotify();
+
+	RuleSet& ruleSet;
+	std::string path;
+	std::string fileName;
+	int signalFd{-1};
+	int inotifyFd{-1};
+};
+
+/**
+ * Classifies whole messages with a RuleEngine, DONTKNOW if no rule matches.
+ */
+class RuleBuildResultParser : public common::BuildResultParser {
+public:
+	RuleBuildResultParser(const std::vector<Rule>& rules);
+
+	common::BuildResult parseMsg(common::StringView msg) override;
+
+private:
+	RuleEngine engine;
+};
+
+} // namespace rules
@@ -0,0 +1,315 @@
+#include "pwm.h"
+#include "fake-sysfs.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * End-to-end cost of PwmRgbLed::set and PwmBeeper::playTone on
+ * LinuxPwmOutput over a FakePwmTree, i.e. of the system calls rather than
+ * of a PWM driver; PwmRgbLed::set also against the former write path, which
+ * opened, wrote and closed the attribute file for every update (both with
+ * the former PwmRgbLed, which wrote all attributes of all channels, and the
+ * current one), and through write-behind outputs, where the latency is that
+ * on the calling thread.
+ * Reports latency and write system calls (from /proc/self/io) per call, the
+ * time from the first to the last duty cycle written by a colour change
+ * (during which a mix of both colours shows; through the worker when there
+ * is one), and finally the timing jitter of the tone sequencer.
+ */
+
+using namespace std;
+
+static const size_t ITERATIONS{20000};
+
+/**
+ * LinuxPwmOutput as it was before keeping the attribute files open.
+ */
+class ReopeningPwmOutput : public pwm::PwmOutput {
+public:
+	ReopeningPwmOutput(const string& basePath, unsigned int pwmchip, unsigned int pwm) :
+		basePath(basePath),
+		pwmchip(pwmchip),
+		pwm(pwm) {
+	}
+
+	void enable(bool en) override {
+		setProperty("enable", en ? "1" : "0");
+	}
+
+	void setPeriodNs(unsigned long int value) override {
+		setProperty("period", to_string(value));
+	}
+
+	void setDutyCycleNs(unsigned long int value) override {
+		setProperty("duty_cycle", to_string(value));
+	}
+
+private:
+	void setProperty(const string& prop, const string& value) {
+		auto propertyPath = basePath + string("/pwmchip") +
+			to_string(pwmchip) + string("/pwm") +
+			to_string(pwm) + string("/") + prop;
+		int fd = open(propertyPath.c_str(), O_WRONLY);
+		if (fd == -1) {
+			printf("ERROR while opening property %s.\n", propertyPath.c_str());
+			return;
+		}
+		if (write(fd, value.c_str(), value.size()) != (ssize_t)value.size())
+			printf("ERROR while writing property %s.\n", propertyPath.c_str());
+		close(fd);
+	}
+
+	string basePath;
+	unsigned int pwmchip;
+	unsigned int pwm;
+};
+
+/**
+ * Times the duty cycle writes to the decorated output, for the settle time
+ * of colour changes applied by a PwmWorker.
+ */
+class TimingPwmOutput : public pwm::PwmOutput {
+public:
+	struct Span {
+		chrono::steady_clock::time_point first;
+		chrono::steady_clock::time_point last;
+		size_t writes{0};
+	};
+
+	TimingPwmOutput(pwm::PwmOutput& output, Span& span) :
+		output(output),
+		span(span) {
+	}
+
+	void enable(bool en) override {
+		output.enable(en);
+	}
+
+	void setPeriodNs(unsigned long int value) override {
+		output.setPeriodNs(value);
+	}
+
+	void setDutyCycleNs(unsigned long int value) override {
+		auto start = chrono::steady_clock::now();
+		output.setDutyCycleNs(value);
+		if (span.writes++ == 0)
+			span.first = start;
+		span.last = chrono::steady_clock::now();
+	}
+
+private:
+	pwm::PwmOutput& output;
+	Span& span;
+};
+
+/**
+ * PwmRgbLed as it was before: every set() writes period, duty cycle and
+ * enable of each channel, computing the duty cycle in floating point.
+ */
+class OriginalPwmRgbLed {
+public:
+	struct Stats {
+		size_t settledCommits{0};
+		chrono::nanoseconds maxSettleTime{0};
+		chrono::nanoseconds totalSettleTime{0};
+	};
+
+	OriginalPwmRgbLed(pwm::PwmOutput& pwmRed, pwm::PwmOutput& pwmGreen,
+			pwm::PwmOutput& pwmBlue) :
+		outputs{&pwmRed, &pwmGreen, &pwmBlue} {
+		for (auto output : outputs) {
+			output->setPeriodNs(PERIOD_NS);
+			output->setDutyCycleNs(0);
+			output->enable(false);
+		}
+	}
+
+	void set(common::LightSetting value) {
+		const unsigned long values[3] = {value.r, value.g, value.b};
+		chrono::steady_clock::time_point first;
+		chrono::steady_clock::time_point last;
+		for (int channel = 0; channel < 3; channel++) {
+			outputs[channel]->setPeriodNs(PERIOD_NS);
+			auto start = chrono::steady_clock::now();
+			outputs[channel]->setDutyCycleNs(
+					PERIOD_NS * DUTY_CYCLE_MAX_RATIO * values[channel] / 255);
+			last = chrono::steady_clock::now();
+			if (channel == 0)
+				first = start;
+			outputs[channel]->enable(true);
+		}
+
+		chrono::nanoseconds settleTime = last - first;
+		stats.settledCommits++;
+		stats.totalSettleTime += settleTime;
+		if (settleTime > stats.maxSettleTime)
+			stats.maxSettleTime = settleTime;
+	}
+
+	Stats getStats() const {
+		return stats;
+	}
+
+private:
+	static constexpr unsigned long PERIOD_NS{70000UL};
+	static constexpr double DUTY_CYCLE_MAX_RATIO{0.8};
+
+	pwm::PwmOutput* outputs[3];
+	Stats stats;
+};
+
+static unsigned long writeSyscalls() {
+	ifstream io("/proc/self/io");
+	string key;
+	unsigned long value;
+	while (io >> key >> value) {
+		if (key == "syscw:")
+			return value;
+	}
+	return 0;
+}
+
+/**
+ * Runs operation ITERATIONS times, after which worker (if any) is flushed.
+ */
+template<typename Operation>
+static void measure(const char* name, Operation operation,
+		pwm::PwmWorker* worker = nullptr) {
+	if (worker)
+		worker->flush();
+
+	unsigned long syscalls = writeSyscalls();
+	chrono::steady_clock::duration total{0};
+	chrono::steady_clock::duration max{0};
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		auto start = chrono::steady_clock::now();
+		operation(i);
+		auto latency = chrono::steady_clock::now() - start;
+		total += latency;
+		if (latency > max)
+			max = latency;
+	}
+	if (worker)
+		worker->flush();
+	syscalls = writeSyscalls() - syscalls;
+
+	printf("%-14s %8.2f us mean %8.2f us max %6.2f writes\n", name,
+			chrono::duration<double, micro>(total).count() / ITERATIONS,
+			chrono::duration<double, micro>(max).count(),
+			(double)syscalls / ITERATIONS);
+}
+
+static void printSettleTime(chrono::nanoseconds total, size_t count,
+		chrono::nanoseconds max) {
+	printf("%-14s %8.2f us mean %8.2f us max\n", "  settle time",
+			chrono::duration<double, micro>(total).count() / count,
+			chrono::duration<double, micro>(max).count());
+}
+
+template<typename Led = pwm::PwmRgbLed>
+static void measureLed(const char* name, pwm::PwmOutput& red,
+		pwm::PwmOutput& green, pwm::PwmOutput& blue) {
+	Led led{red, green, blue};
+	measure(name, [&](size_t i) {
+		led.set((i % 2) ? common::RED : common::GREEN);
+	});
+
+	auto stats = led.getStats();
+	printSettleTime(stats.totalSettleTime, stats.settledCommits,
+			stats.maxSettleTime);
+}
+
+/**
+ * As measureLed, on AsyncPwmOutputs over outputs timed into span. The
+ * commit only queues the writes, so the settle time is measured where the
+ * worker writes them, one colour change at a time.
+ */
+static void measureAsyncLed(const char* name, pwm::PwmOutput& red,
+		pwm::PwmOutput& green, pwm::PwmOutput& blue, pwm::PwmWorker& worker,
+		TimingPwmOutput::Span& span) {
+	pwm::PwmRgbLed led{red, green, blue};
+	measure(name, [&](size_t i) {
+		led.set((i % 2) ? common::RED : common::GREEN);
+	}, &worker);
+
+	chrono::nanoseconds total{0};
+	chrono::nanoseconds max{0};
+	size_t settled = 0;
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		span = TimingPwmOutput::Span{};
+		led.set((i % 2) ? common::RED : common::GREEN);
+		worker.flush();
+		if (span.writes == 0)
+			continue;
+		auto settleTime = span.last - span.first;
+		total += settleTime;
+		if (settleTime > max)
+			max = settleTime;
+		settled++;
+	}
+	printSettleTime(total, settled, max);
+}
+
+int main() {
+	// Laid out like on the board: beeper, blue, green, red.
+	FakePwmTree sysfs{4};
+	const string& basePath = sysfs.getBasePath();
+	pwm::LinuxPwmOutput beeperOutput{basePath, 0, 0};
+	pwm::LinuxPwmOutput blue{basePath, 1, 0};
+	pwm::LinuxPwmOutput green{basePath, 2, 0};
+	pwm::LinuxPwmOutput red{basePath, 3, 0};
+
+	printf("per PwmRgbLed::set, alternating red and green:\n");
+	{
+		ReopeningPwmOutput reopeningRed{basePath, 3, 0};
+		ReopeningPwmOutput reopeningGreen{basePath, 2, 0};
+		ReopeningPwmOutput reopeningBlue{basePath, 1, 0};
+		measureLed<OriginalPwmRgbLed>("original", reopeningRed,
+				reopeningGreen, reopeningBlue);
+		measureLed("reopening", reopeningRed, reopeningGreen, reopeningBlue);
+	}
+	measureLed("persistent", red, green, blue);
+	{
+		TimingPwmOutput::Span span;
+		TimingPwmOutput timedRed{red, span};
+		TimingPwmOutput timedGreen{green, span};
+		TimingPwmOutput timedBlue{blue, span};
+		pwm::PwmWorker worker;
+		pwm::AsyncPwmOutput asyncRed{timedRed, worker};
+		pwm::AsyncPwmOutput asyncGreen{timedGreen, worker};
+		pwm::AsyncPwmOutput asyncBlue{timedBlue, worker};
+		measureAsyncLed("async", asyncRed, asyncGreen, asyncBlue, worker, span);
+	}
+
+	printf("per PwmBeeper::playTone, without sleeping:\n");
+	{
+		pwm::PwmBeeper beeper{beeperOutput, [](uint16_t) {}};
+		measure("same tone", [&](size_t) {
+			beeper.playTone(common::BeeperTone{1000, 1000});
+		});
+		measure("changing tone", [&](size_t i) {
+			beeper.playTone(common::BeeperTone{1000, (uint16_t)(440 + i % 100)});
+		});
+	}
+
+	{
+		pwm::ToneSequencer sequencer{beeperOutput};
+		vector<common::BeeperTone> melody;
+		for (uint16_t i = 0; i < 200; i++)
+			melody.push_back(common::BeeperTone{5, (uint16_t)(440 + i)});
+		sequencer.play(melody);
+		sequencer.waitIdle();
+
+		auto stats = sequencer.getStats();
+		printf("tone sequencer, 200 tones of 5 ms:\n");
+		printf("%-14s %8.2f us mean %8.2f us max\n", "jitter",
+				chrono::duration<double, micro>(stats.totalJitter).count() /
+					stats.deadlines,
+				chrono::duration<double, micro>(stats.maxJitter).count());
+	}
+	return 0;
+}
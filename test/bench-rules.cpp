@@ -0,0 +1,77 @@
+#include "rules.h"
+
+#include <chrono>
+#include <cstdio>
+
+/**
+ * Classification cost of the rule engine with 1 and with 100 rules, against
+ * one find() pass per rule. Reports nanoseconds per message.
+ */
+
+using namespace std;
+using common::BuildResult;
+using common::StringView;
+
+static const size_t ITERATIONS{2000};
+
+static string makeMessage() {
+	string msg{"{\"name\":\"ciSpy\",\"url\":\"job/ciSpy/\",\"build\":{"
+		"\"full_url\":\"http://ci.example.com/job/ciSpy/1234/\","
+		"\"number\":1234,\"phase\":\"COMPLETED\",\"log\":\""};
+	while (msg.size() < 16 * 1024)
+		msg += "[INFO] Building module, compiling sources, linking binary. ";
+	msg += "\",\"status\":\"FAILURE\"}}";
+	return msg;
+}
+
+static vector<rules::Rule> makeRules(size_t count) {
+	vector<rules::Rule> ruleSet;
+	for (size_t i = 1; i < count; i++) {
+		char pattern[32];
+		snprintf(pattern, sizeof(pattern), "STATUS_%03zu", i);
+		ruleSet.push_back(rules::Rule{pattern, BuildResult::DONTKNOW});
+	}
+	ruleSet.push_back(rules::Rule{"FAILURE", BuildResult::BROKEN});
+	return ruleSet;
+}
+
+template<typename Classify>
+static double nsPerMessage(const string& msg, Classify classify) {
+	size_t broken = 0;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < ITERATIONS; i++)
+		broken += classify(StringView{msg}) == BuildResult::BROKEN;
+	auto elapsed = chrono::steady_clock::now() - start;
+	if (broken != ITERATIONS)
+		printf("ERROR: misclassified message.\n");
+	return chrono::duration<double, nano>(elapsed).count() / ITERATIONS;
+}
+
+int main() {
+	string msg = makeMessage();
+	printf("message: %zu bytes\n", msg.size());
+
+	for (size_t count : {1, 100}) {
+		auto ruleSet = makeRules(count);
+		rules::RuleEngine engine{ruleSet};
+
+		double automaton = nsPerMessage(msg, [&](StringView m) {
+			BuildResult result = BuildResult::DONTKNOW;
+			engine.classify(m, result);
+			return result;
+		});
+		double naive = nsPerMessage(msg, [&](StringView m) {
+			size_t best = ruleSet.size();
+			for (size_t i = 0; i < ruleSet.size(); i++) {
+				if (i < best && m.find(StringView{ruleSet[i].pattern}) != StringView::npos)
+					best = i;
+			}
+			return best < ruleSet.size() ? ruleSet[best].result : BuildResult::DONTKNOW;
+		});
+
+		printf("%3zu rules: automaton %8.0f ns/msg (%zu states), "
+				"find() per rule %8.0f ns/msg\n",
+				count, automaton, engine.getStateCount(), naive);
+	}
+	return 0;
+}
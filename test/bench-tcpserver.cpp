@@ -0,0 +1,161 @@
+#include "network.h"
+#include "uring.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+/**
+ * Connection-per-message throughput of the original blocking TcpServer
+ * against the io_uring based server. Reports messages per second and the
+ * number of syscalls per message issued on the server side, as counted by
+ * the servers.
+ */
+
+using namespace std;
+
+static const size_t MESSAGES{5000};
+
+/**
+ * The blocking server listens with a backlog of 5; beyond that, SYNs are
+ * dropped and connect() waits for a retransmit, which would dominate the
+ * measurement. So the client keeps at most this many messages in flight.
+ */
+static const size_t IN_FLIGHT_MAX{4};
+static atomic<size_t> received{0};
+static const uint16_t BLOCKING_PORT{12346};
+static const string MSG{"{\"name\":\"bench\",\"build\":{\"phase\":\"COMPLETED\","
+	"\"status\":\"SUCCESS\",\"number\":1}}"};
+
+/**
+ * TcpServer as it was before the epoll and io_uring servers: accept(), a
+ * single recv() into a fixed buffer and close() per message.
+ */
+class SingleRecvTcpServer {
+public:
+	SingleRecvTcpServer(uint16_t port) {
+		if ((createSocket = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+			throw std::runtime_error("cannot create socket.");
+
+		const int optVal{1};
+		setsockopt(createSocket, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+
+		listenAddress.sin_family = AF_INET;
+		listenAddress.sin_addr.s_addr = INADDR_ANY;
+		listenAddress.sin_port = htons(port);
+		if (bind(createSocket, (struct sockaddr *) &listenAddress,
+					sizeof (listenAddress)) != 0)
+			throw std::runtime_error("bind error: cannot listen on port.");
+
+		if (listen(createSocket, BACKLOG_LEN_MAX) != 0)
+			throw std::runtime_error("listen error.");
+	}
+
+	~SingleRecvTcpServer() {
+		close(createSocket);
+	}
+
+	string receiveClientMsg() {
+		socklen_t addrlen{sizeof(struct sockaddr_in)};
+		int rxSocket = accept(createSocket, (struct sockaddr*)&listenAddress,
+				&addrlen);
+		if (rxSocket <= 0)
+			throw std::runtime_error("error on accept()");
+
+		ssize_t size = recv(rxSocket, rxBuffer, RECEIVE_BUF_LEN-1, 0);
+		if (size > 0)
+			rxBuffer[size] = '\0';
+
+		close(rxSocket);
+		syscallCount += 3;
+		string out(rxBuffer);
+		return out;
+	}
+
+	size_t getSyscallCount() const {
+		return syscallCount;
+	}
+
+private:
+	const int RECEIVE_BUF_LEN{1500};
+	const int BACKLOG_LEN_MAX{5};
+	int createSocket;
+	struct sockaddr_in listenAddress;
+	char rxBuffer[1500];
+	size_t syscallCount{0};
+};
+
+static void sendMessages(uint16_t port, size_t count) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	for (size_t i = 0; i < count; i++) {
+		while (i - received.load() >= IN_FLIGHT_MAX)
+			this_thread::yield();
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		while (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+			close(fd);
+			this_thread::yield();
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+		}
+		if (send(fd, MSG.data(), MSG.size(), 0) != (ssize_t)MSG.size())
+			printf("ERROR on send().\n");
+		close(fd);
+	}
+}
+
+/**
+ * Runs receive until MESSAGES were received; it returns the bytes received.
+ */
+template<typename Receive>
+static void benchmark(const char* name, Receive receive, uint16_t port,
+		const function<size_t()>& getSyscallCount) {
+	received.store(0);
+	thread client(sendMessages, port, MESSAGES);
+
+	auto start = chrono::steady_clock::now();
+	size_t bytes = 0;
+	while (received.load() < MESSAGES)
+		bytes += receive();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	client.join();
+
+	if (bytes != MESSAGES * MSG.size())
+		printf("ERROR: received %zu bytes, expected %zu.\n", bytes, MESSAGES * MSG.size());
+
+	printf("%-10s %10.0f msg/s %8.2f syscalls/msg\n", name,
+			MESSAGES / elapsed.count(),
+			(double)getSyscallCount() / MESSAGES);
+}
+
+int main(void) {
+	SingleRecvTcpServer blocking{BLOCKING_PORT};
+	benchmark("blocking", [&]() {
+		size_t size = blocking.receiveClientMsg().size();
+		received++;
+		return size;
+	}, BLOCKING_PORT, [&]() { return blocking.getSyscallCount(); });
+
+	try {
+		size_t bytes = 0;
+		network::UringTcpServer uring{0, [&bytes](common::StringView msg) {
+			bytes += msg.size();
+			received++;
+		}};
+		benchmark("io_uring", [&]() {
+			bytes = 0;
+			uring.poll(-1);
+			return bytes;
+		}, uring.getPort(), [&]() { return uring.getSyscallCount(); });
+	} catch (const std::runtime_error& e) {
+		printf("%-10s not available: %s\n", "io_uring", e.what());
+	}
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * A /sys/class/pwm lookalike in a temporary directory, for running
+ * LinuxPwmOutput against real files: pwmchip0..pwmchipN-1 with an export
+ * file each. A thread watches the export files with inotify and, like the
+ * kernel, creates pwmM with period, duty_cycle and enable when M is written.
+ * Attribute files are plain files, so a value is their first line.
+ */
+class FakePwmTree {
+public:
+	FakePwmTree(unsigned int chips) :
+		chips(chips),
+		inotifyFd(inotify_init1(IN_CLOEXEC)),
+		stopFd(eventfd(0, EFD_CLOEXEC)) {
+
+		char dir[] = "/tmp/ciSpy-sysfs-XXXXXX";
+		if (inotifyFd < 0 || stopFd < 0 || !mkdtemp(dir))
+			throw std::runtime_error("cannot create fake sysfs tree");
+		basePath = dir;
+		for (unsigned int chip = 0; chip < chips; chip++) {
+			mkdir(getChipPath(chip).c_str(), 0700);
+			std::ofstream(getChipPath(chip) + "/export");
+			watches.push_back(inotify_add_watch(inotifyFd,
+						getChipPath(chip).c_str(), IN_CLOSE_WRITE));
+		}
+		thread = std::thread(&FakePwmTree::run, this);
+	}
+
+	~FakePwmTree() {
+		uint64_t one = 1;
+		if (write(stopFd, &one, sizeof(one)) == sizeof(one))
+			thread.join();
+		else
+			thread.detach();
+		close(inotifyFd);
+		close(stopFd);
+
+		for (unsigned int chip = 0; chip < chips; chip++) {
+			std::string chipPath = getChipPath(chip);
+			for (unsigned int pwm = 0; pwm < PWMS_MAX; pwm++) {
+				std::string pwmPath = chipPath + "/pwm" + std::to_string(pwm);
+				for (auto name : {"period", "duty_cycle", "enable"})
+					unlink((pwmPath + "/" + name).c_str());
+				rmdir(pwmPath.c_str());
+			}
+			unlink((chipPath + "/export").c_str());
+			rmdir(chipPath.c_str());
+		}
+		rmdir(basePath.c_str());
+	}
+
+	const std::string& getBasePath() const {
+		return basePath;
+	}
+
+	std::string read(unsigned int chip, unsigned int pwm, const std::string& name) const {
+		std::ifstream in(getChipPath(chip) + "/pwm" + std::to_string(pwm) + "/" + name);
+		std::string value;
+		std::getline(in, value);
+		return value;
+	}
+
+private:
+	static const unsigned int PWMS_MAX{4};
+
+	std::string getChipPath(unsigned int chip) const {
+		return basePath + "/pwmchip" + std::to_string(chip);
+	}
+
+	void run() {
+		struct pollfd fds[2] = {
+			{stopFd, POLLIN, 0},
+			{inotifyFd, POLLIN, 0}
+		};
+		alignas(struct inotify_event) char buffer[4096];
+		while (::poll(fds, 2, -1) >= 0 && !(fds[0].revents & POLLIN)) {
+			ssize_t len = ::read(inotifyFd, buffer, sizeof(buffer));
+			for (char* p = buffer; len > 0 && p < buffer + len; ) {
+				auto event = reinterpret_cast<struct inotify_event*>(p);
+				auto watch = std::find(watches.begin(), watches.end(), event->wd);
+				if (event->len > 0 && std::string(event->name) == "export" &&
+						watch != watches.end())
+					exportPwm(watch - watches.begin());
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+
+	void exportPwm(unsigned int chip) {
+		std::string chipPath = getChipPath(chip);
+		unsigned int pwm = PWMS_MAX;
+		std::ifstream(chipPath + "/export") >> pwm;
+		if (pwm >= PWMS_MAX)
+			return;
+
+		std::string pwmPath = chipPath + "/pwm" + std::to_string(pwm);
+		if (mkdir(pwmPath.c_str(), 0700) != 0)
+			return; // exported before
+		// Created under another name, so that no attribute is seen empty.
+		for (auto name : {"period", "duty_cycle", "enable"}) {
+			std::ofstream(pwmPath + "/.tmp") << "0\n";
+			rename((pwmPath + "/.tmp").c_str(), (pwmPath + "/" + name).c_str());
+		}
+	}
+
+	std::string basePath;
+	unsigned int chips;
+	int inotifyFd;
+	int stopFd;
+	std::vector<int> watches; // by chip
+	std::thread thread;
+};
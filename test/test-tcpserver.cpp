@@ -1,11 +1,16 @@
 #include "network.h"
+#include "uring.h"
 #include <iostream>
 
 using namespace std;
 
 int main(void) {
-	network::TcpServer tcpServer(12345);
-	std::string msg = tcpServer.receiveClientMsg();
+	string msg;
+	auto tcpServer = network::makeTcpServer(12345, [&msg](common::StringView m) {
+		msg = m.toString();
+	});
+	while (msg.empty())
+		tcpServer->poll(-1);
 	cout << msg;
 
 	return 0;
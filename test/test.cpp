@@ -2,18 +2,33 @@
 #include "gmock/gmock.h"
 
 #include "common.h"
+#include "animation.h"
 #include "pwm.h"
 #include "filesystem.h"
+#include "json.h"
+#include "parsers.h"
+#include "rules.h"
+#include "network.h"
+#include "pipeline.h"
+#include "pixels.h"
+#include "uring.h"
+#include "fake-sysfs.h"
 #include "strings.h"
 
+#include <climits>
+#include <fstream>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 
+#include <sys/resource.h>
+#include <sys/stat.h>
+
 /**
  * TEST LIST
  *
  * - red led sometimes blinks
- * - test LinuxPwmOutput via (real) files
  */
 
 using ::testing::EmptyTestEventListener;
@@ -29,12 +44,15 @@ using ::testing::StrictMock;
 using ::testing::_;
 using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
+using ::testing::UnorderedElementsAre;
 using ::testing::Args;
 using ::testing::SaveArg;
 using ::testing::Invoke;
 using ::testing::Return;
 using ::testing::SetArgReferee;
 using ::testing::DoAll;
+using ::testing::Gt;
+using ::testing::Mock;
 
 using namespace std;
 using namespace common;
@@ -102,6 +120,19 @@ TEST_F(BeeperToneTest, comparison) {
 	ASSERT_EQ(tone0, tone1);
 }
 
+class TestBuildStatistics : public common::BuildStatistics {
+public:
+	size_t getFlakyJobCount() const override {
+		return flakyJobs;
+	}
+
+	bool getJobStatistics(uint64_t, common::JobStatistics&) const override {
+		return false;
+	}
+
+	size_t flakyJobs{0};
+};
+
 class SignalizerTest : public testing::Test {
 protected:
 	TestBeeper beeper;
@@ -145,6 +176,18 @@ TEST_F(SignalizerTest, noLightChangeOnUnknownBuildState) {
 	ASSERT_EQ(rgbLight.get(), l);
 }
 
+TEST_F(SignalizerTest, lightTurnsAmberIfOkButFlaky) {
+	TestBuildStatistics statistics;
+	s.setStatistics(&statistics);
+
+	s.update(BuildResult::OK);
+	ASSERT_EQ(rgbLight.get(), (LightSetting{0, 255, 0}));
+
+	statistics.flakyJobs = 1;
+	s.update(BuildResult::OK);
+	ASSERT_EQ(rgbLight.get(), (LightSetting{255, 128, 0}));
+}
+
 TEST_F(SignalizerTest, noErrorBeepOnUnknownBuildState) {
 	s.update(BuildResult::DONTKNOW);
 	BeeperTone noTone;
@@ -187,6 +230,822 @@ TEST_F(JenkinsBuildResultParserTest, dontKnow) {
 	ASSERT_EQ(result, BuildResult::DONTKNOW);
 }
 
+TEST_F(JenkinsBuildResultParserTest, jsonIgnoresStatusWordsInChanges) {
+	JenkinsBuildResultParser parser;
+	auto msg = R"({"name":"Foo","url":"job/Foo/",
+		"build":{"full_url":"http://ci/job/Foo/7/","number":7,
+			"scm":{"changes":["Fix \"FAILURE\" in {login}"]},
+			"phase":"COMPLETED","status":"SUCCESS"}})";
+	ASSERT_EQ(parser.parseMsg(msg), BuildResult::OK);
+}
+
+TEST_F(JenkinsBuildResultParserTest, jsonFields) {
+	auto msg = R"({"name":"Foo \"bar\"","build":{"number":42,
+		"phase":"FINALIZED","status":"FAILURE","log":"SUCCESS"}} trailing garbage)";
+	common::JenkinsNotification notification;
+	ASSERT_TRUE(JenkinsBuildResultParser::parseJson(msg, notification));
+	ASSERT_EQ(notification.name, StringView{R"(Foo \"bar\")"});
+	ASSERT_EQ(notification.phase, StringView{"FINALIZED"});
+	ASSERT_EQ(notification.status, StringView{"FAILURE"});
+	ASSERT_EQ(notification.number, 42);
+}
+
+TEST_F(JenkinsBuildResultParserTest, jsonStopsWhenFieldsAreFound) {
+	// Everything after the last needed field is never looked at.
+	auto msg = R"({"name":"Foo","build":{"number":1,"phase":"COMPLETED",
+		"status":"FAILURE",)" "\x01{[[[";
+	ASSERT_EQ(JenkinsBuildResultParser().parseMsg(msg), BuildResult::BROKEN);
+}
+
+TEST_F(JenkinsBuildResultParserTest, eventNamesJob) {
+	JenkinsBuildResultParser parser;
+	auto event = parser.parseEvent(R"({"name":"Foo","build":{"status":"FAILURE"}})");
+	ASSERT_EQ(event.result, BuildResult::BROKEN);
+	ASSERT_EQ(event.job, common::fingerprint("Foo"));
+	event = parser.parseEvent("<job><name>Foo</name><build><status>SUCCESS</status></build></job>");
+	ASSERT_EQ(event.job, common::fingerprint("Foo"));
+	ASSERT_EQ(parser.parseEvent("SUCCESS").job, 0u);
+}
+
+TEST_F(JenkinsBuildResultParserTest, jsonWithoutStatus) {
+	JenkinsBuildResultParser parser;
+	auto msg = R"({"name":"Foo","build":{"number":1,"phase":"STARTED"}})";
+	ASSERT_EQ(parser.parseMsg(msg), BuildResult::DONTKNOW);
+	ASSERT_EQ(parser.parseMsg("FAILURE\n"), BuildResult::BROKEN);
+}
+
+TEST_F(JenkinsBuildResultParserTest, configuredStatusRules) {
+	JenkinsBuildResultParser parser{{
+		{"SUCCESS", BuildResult::OK},
+		{"FAILURE", BuildResult::BROKEN},
+		{"UNSTABLE", BuildResult::BROKEN}}};
+	auto msg = R"({"name":"Foo","build":{"phase":"COMPLETED","status":"UNSTABLE"}})";
+	ASSERT_EQ(parser.parseMsg(msg), BuildResult::BROKEN);
+	ASSERT_EQ(JenkinsBuildResultParser().parseMsg(msg), BuildResult::DONTKNOW);
+}
+
+TEST(RuleEngineTest, firstListedRuleWins) {
+	rules::RuleEngine engine{{
+		{"FAILURE", BuildResult::BROKEN},
+		{"SUCCESS", BuildResult::OK}}};
+	BuildResult result;
+	ASSERT_TRUE(engine.classify("SUCCESS after FAILURE", result));
+	ASSERT_EQ(result, BuildResult::BROKEN);
+	ASSERT_TRUE(engine.classify("xxSUCCESSxx", result));
+	ASSERT_EQ(result, BuildResult::OK);
+	ASSERT_FALSE(engine.classify("SUCCES FAILUR", result));
+}
+
+TEST(RuleEngineTest, overlappingPatterns) {
+	rules::RuleEngine engine{{
+		{"hers", BuildResult::BROKEN},
+		{"she", BuildResult::OK},
+		{"he", BuildResult::DONTKNOW}}};
+	BuildResult result;
+	ASSERT_TRUE(engine.classify("ushers", result));
+	ASSERT_EQ(result, BuildResult::BROKEN);
+	ASSERT_TRUE(engine.classify("ushe", result));
+	ASSERT_EQ(result, BuildResult::OK);
+	ASSERT_TRUE(engine.classify("the", result));
+	ASSERT_EQ(result, BuildResult::DONTKNOW);
+	ASSERT_EQ(engine.getStateCount(), 8u); // root, h-e-r-s, s-h-e
+}
+
+TEST(RuleEngineTest, manyRules) {
+	vector<rules::Rule> ruleSet;
+	for (int i = 0; i < 100; i++) {
+		ruleSet.push_back({"RULE_" + to_string(i) + ";",
+				(i % 2) ? BuildResult::BROKEN : BuildResult::OK});
+	}
+	ruleSet.push_back({"RULE_41;", BuildResult::OK}); // shadowed
+	rules::RuleBuildResultParser parser{ruleSet};
+
+	ASSERT_EQ(parser.parseMsg("status RULE_41; in one pass"), BuildResult::BROKEN);
+	ASSERT_EQ(parser.parseMsg("RULE_1RULE_42;"), BuildResult::OK);
+	ASSERT_EQ(parser.parseMsg("RULE_100;"), BuildResult::DONTKNOW);
+}
+
+TEST(RuleSetTest, parseRules) {
+	istringstream text{"# comment\n\nBROKEN  FAILURE\r\nOK\tbuild passed\n"};
+	auto rules = rules::parseRules(text);
+	ASSERT_EQ(rules.size(), 2u);
+	ASSERT_EQ(rules[0].pattern, "FAILURE");
+	ASSERT_EQ(rules[0].result, BuildResult::BROKEN);
+	ASSERT_EQ(rules[1].pattern, "build passed");
+	ASSERT_EQ(rules[1].result, BuildResult::OK);
+
+	istringstream malformed{"OK SUCCESS\nBORKEN FAILURE\n"};
+	ASSERT_THROW(rules::parseRules(malformed), runtime_error);
+	istringstream noPattern{"OK\n"};
+	ASSERT_THROW(rules::parseRules(noPattern), runtime_error);
+}
+
+TEST(RuleSetTest, publishWhileClassifying) {
+	rules::RuleSet ruleSet{{{"FAILURE", BuildResult::BROKEN}}};
+	atomic<bool> stop{false};
+	atomic<size_t> unexpected{0};
+	thread reader([&]() {
+		while (!stop.load()) {
+			BuildResult result = BuildResult::DONTKNOW;
+			ruleSet.classify("FAILURE", result);
+			if (result == BuildResult::DONTKNOW)
+				unexpected++;
+		}
+	});
+
+	for (int i = 0; i < 100; i++) {
+		auto result = (i % 2) ? BuildResult::BROKEN : BuildResult::OK;
+		ruleSet.publish(unique_ptr<rules::RuleEngine>(
+					new rules::RuleEngine({{"FAILURE", result}})));
+	}
+	stop = true;
+	reader.join();
+
+	BuildResult result;
+	ASSERT_TRUE(ruleSet.classify("FAILURE", result));
+	ASSERT_EQ(result, BuildResult::BROKEN);
+	ASSERT_EQ(ruleSet.getGeneration(), 100u);
+	ASSERT_EQ(unexpected.load(), 0u);
+}
+
+class RuleFileReloaderTest : public ::testing::Test {
+protected:
+	void writeRules(const string& text) {
+		// Replaced via rename like editors do.
+		string tmp = dir + "/rules.tmp";
+		ofstream(tmp) << text;
+		rename(tmp.c_str(), path.c_str());
+	}
+
+	void TearDown() override {
+		unlink(path.c_str());
+		rmdir(dir.c_str());
+	}
+
+	static string makeTempDir() {
+		char dir[] = "/tmp/ciSpy-rules-XXXXXX";
+		return mkdtemp(dir);
+	}
+
+	string dir = makeTempDir();
+	string path = dir + "/rules";
+	shared_ptr<rules::RuleSet> statusRules =
+		make_shared<rules::RuleSet>(parsers::defaultStatusRules());
+	parsers::DefaultParsers parsers{statusRules};
+	rules::RuleFileReloader reloader{*statusRules, path};
+};
+
+TEST_F(RuleFileReloaderTest, rawMessagesKeepWholeMessageRules) {
+	auto& registry = parsers.getRegistry();
+	ASSERT_EQ(registry.parseMsg("no error, all tests passed"), BuildResult::DONTKNOW);
+	ASSERT_EQ(registry.parseMsg("deploy failed"), BuildResult::DONTKNOW);
+	ASSERT_EQ(registry.parseMsg("FAILURE"), BuildResult::BROKEN);
+	ASSERT_EQ(registry.parseMsg("SUCCESS"), BuildResult::OK);
+	ASSERT_EQ(registry.parseMsg(R"({"id":2,"sha":"abc","context":"ci","state":"error"})"),
+			BuildResult::BROKEN);
+}
+
+TEST_F(RuleFileReloaderTest, reloadsOnChange) {
+	auto unstable = R"({"name":"Foo","build":{"status":"UNSTABLE"}})";
+	ASSERT_EQ(parsers.getRegistry().parseMsg(unstable), BuildResult::DONTKNOW);
+
+	writeRules("BROKEN UNSTABLE\nBROKEN FAILURE\nOK SUCCESS\n");
+	ASSERT_TRUE(reloader.poll(1000));
+	ASSERT_EQ(parsers.getRegistry().parseMsg(unstable), BuildResult::BROKEN);
+
+	// Broken files keep the rules in place.
+	writeRules("UNSTABLE\n");
+	ASSERT_FALSE(reloader.poll(1000));
+	ASSERT_EQ(parsers.getRegistry().parseMsg(unstable), BuildResult::BROKEN);
+	ASSERT_EQ(statusRules->getGeneration(), 1u);
+}
+
+class ParserRegistryTest : public ::testing::Test {
+protected:
+	parsers::DefaultParsers defaultParsers;
+	parsers::ParserRegistry& registry{defaultParsers.getRegistry()};
+};
+
+TEST_F(ParserRegistryTest, jenkins) {
+	ASSERT_EQ(registry.parseMsg(R"({"name":"Foo","build":{"status":"FAILURE"}})"),
+			BuildResult::BROKEN);
+	ASSERT_EQ(registry.parseMsg("<job><build><status>SUCCESS</status></build></job>"),
+			BuildResult::OK);
+	ASSERT_EQ(registry.parseMsg("FAILURE"), BuildResult::BROKEN);
+}
+
+TEST_F(ParserRegistryTest, gitLab) {
+	ASSERT_EQ(registry.parseMsg(R"({"object_kind":"pipeline",
+		"object_attributes":{"id":31,"status":"failed"},
+		"commits":[{"message":"status success"}]})"), BuildResult::BROKEN);
+	ASSERT_EQ(registry.parseMsg(R"({"object_kind":"build","build_status":"success"})"),
+			BuildResult::OK);
+	ASSERT_EQ(registry.parseMsg(R"({"object_kind":"pipeline",
+		"object_attributes":{"status":"running"}})"), BuildResult::DONTKNOW);
+}
+
+TEST_F(ParserRegistryTest, gitHub) {
+	ASSERT_EQ(registry.parseMsg(R"( {"action":"completed","workflow_run":{
+		"name":"CI","status":"completed","conclusion":"failure"}})"),
+			BuildResult::BROKEN);
+	ASSERT_EQ(registry.parseMsg(R"({"action":"requested","workflow_run":{
+		"status":"queued","conclusion":null}})"), BuildResult::DONTKNOW);
+	ASSERT_EQ(registry.parseMsg(R"({"id":1,"sha":"abc","state":"success",
+		"context":"ci","name":"foo/bar"})"), BuildResult::OK);
+	ASSERT_EQ(registry.parseMsg(R"({"id":2,"sha":"abc","name":"foo/bar",
+		"target_url":null,"context":"ci","state":"error"})"), BuildResult::BROKEN);
+}
+
+TEST_F(ParserRegistryTest, sniffsFirstTopLevelKeys) {
+	ASSERT_EQ(registry.parseMsg(R"({"id":31,"object_attributes":{"status":"failed"},
+		"object_kind":"pipeline"})"), BuildResult::BROKEN);
+	ASSERT_EQ(registry.parseMsg(R"({"id":7,"name":"CI","check_suite":{
+		"conclusion":"failure","app":{"name":"x"}},"action":"completed"})"),
+			BuildResult::BROKEN);
+
+	// Only the first keys are looked at.
+	string late = "{";
+	for (size_t i = 0; i < parsers::ParserRegistry::SNIFFED_KEYS_MAX; i++)
+		late += "\"key" + to_string(i) + "\":{\"object_kind\":0},";
+	late += R"("object_kind":"pipeline","object_attributes":{"status":"failed"}})";
+	ASSERT_EQ(&registry.select(late), &registry.select(R"({"name":"Foo"})"));
+
+	// Keys of nested objects do not count.
+	ASSERT_EQ(&registry.select(R"({"build":{"object_kind":"x"},"name":"Foo"})"),
+			&registry.select(R"({"name":"Foo"})"));
+	ASSERT_NE(&registry.select(R"({"build":{"object_kind":"x"},"name":"Foo"})"),
+			&registry.select(R"({"object_kind":"x"})"));
+	ASSERT_EQ(&registry.select(""), &registry.select("{}"));
+}
+
+TEST(JsonReaderTest, tokens) {
+	using Token = json::JsonReader::Token;
+	json::JsonReader reader{R"( {"a": [1, -2.5e3, true, null], "b": {"c": "x\\"}} )"};
+	vector<Token> tokens;
+	vector<string> values;
+	Token token;
+	while ((token = reader.next()) != Token::END && token != Token::ERROR) {
+		tokens.push_back(token);
+		if (token == Token::KEY || token == Token::STRING ||
+				token == Token::NUMBER || token == Token::LITERAL)
+			values.push_back(reader.getValue().toString());
+	}
+	ASSERT_EQ(token, Token::END);
+	ASSERT_THAT(tokens, ElementsAre(Token::BEGIN_OBJECT, Token::KEY,
+				Token::BEGIN_ARRAY, Token::NUMBER, Token::NUMBER, Token::LITERAL,
+				Token::LITERAL, Token::END_ARRAY, Token::KEY, Token::BEGIN_OBJECT,
+				Token::KEY, Token::STRING, Token::END_OBJECT, Token::END_OBJECT));
+	ASSERT_THAT(values, ElementsAre("a", "1", "-2.5e3", "true", "null", "b",
+				"c", "x\\\\"));
+}
+
+TEST(JsonReaderTest, skipValue) {
+	using Token = json::JsonReader::Token;
+	json::JsonReader reader{R"({"skip": {"s": "}]\"{", "n": [[1], {}]}, "next": 1})"};
+	ASSERT_EQ(reader.next(), Token::BEGIN_OBJECT);
+	ASSERT_EQ(reader.next(), Token::KEY);
+	ASSERT_TRUE(reader.skipValue());
+	ASSERT_EQ(reader.next(), Token::KEY);
+	ASSERT_EQ(reader.getValue(), StringView{"next"});
+	ASSERT_EQ(reader.getDepth(), 1);
+}
+
+class DatagramReceiverTest : public ::testing::Test {
+protected:
+	network::DatagramReceiver::MessageHandler handler{[this](StringView msg) {
+		received.push_back(msg.toString());
+	}};
+	vector<string> received;
+};
+
+TEST_F(DatagramReceiverTest, udpBatches) {
+	network::DatagramReceiver receiver{0, handler};
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(receiver.getPort());
+
+	const size_t COUNT{100};
+	for (size_t i = 0; i < COUNT; i++) {
+		auto msg = to_string(i);
+		ASSERT_EQ(sendto(fd, msg.data(), msg.size(), 0,
+					(struct sockaddr*)&address, sizeof(address)), (ssize_t)msg.size());
+	}
+	close(fd);
+
+	for (int i = 0; i < 100 && received.size() < COUNT; i++)
+		receiver.poll(10);
+	ASSERT_EQ(received.size(), COUNT);
+	ASSERT_EQ(received[42], "42");
+	ASSERT_LT(receiver.getBatchCount(), COUNT / 10);
+}
+
+TEST_F(DatagramReceiverTest, unixSocket) {
+	string path = "/tmp/ciSpy-test-" + to_string(getpid()) + ".sock";
+	network::DatagramReceiver receiver{path, handler};
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	ASSERT_EQ(sendto(fd, "SUCCESS", 7, 0, (struct sockaddr*)&address,
+				sizeof(address)), 7);
+	close(fd);
+
+	receiver.poll(100);
+	ASSERT_THAT(received, ElementsAre("SUCCESS"));
+}
+
+class SpscQueueTest : public ::testing::Test {
+protected:
+	pipeline::SpscQueue<int, 4> queue;
+};
+
+TEST_F(SpscQueueTest, fifoAndBounded) {
+	int out;
+	ASSERT_FALSE(queue.tryPop(out));
+	for (int i = 0; i < 4; i++)
+		ASSERT_TRUE(queue.push(i));
+	ASSERT_FALSE(queue.push(4));
+	ASSERT_EQ(queue.getDroppedCount(), 1u);
+
+	for (int i = 0; i < 4; i++) {
+		ASSERT_TRUE(queue.tryPop(out));
+		ASSERT_EQ(out, i);
+	}
+	ASSERT_FALSE(queue.tryPop(out));
+}
+
+TEST_F(SpscQueueTest, waitPopTimesOut) {
+	int out;
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(5);
+	ASSERT_FALSE(queue.waitPopUntil(out, deadline));
+	ASSERT_GE(chrono::steady_clock::now(), deadline);
+}
+
+TEST_F(SpscQueueTest, producerAndConsumerThreads) {
+	const int COUNT{100000};
+	thread producer([this, COUNT]() {
+		for (int i = 0; i < COUNT; i++) {
+			while (!queue.push(i))
+				this_thread::yield();
+		}
+	});
+
+	int out;
+	for (int i = 0; i < COUNT; i++) {
+		queue.waitPop(out);
+		ASSERT_EQ(out, i);
+	}
+	producer.join();
+}
+
+TEST(FanInQueueTest, mergesProducers) {
+	const int PRODUCERS{3};
+	const int COUNT{10000};
+	pipeline::FanInQueue<int, 64> queue{PRODUCERS};
+
+	vector<thread> producers;
+	for (int p = 0; p < PRODUCERS; p++) {
+		producers.emplace_back([&queue, p, COUNT]() {
+			for (int i = 0; i < COUNT; i++) {
+				while (!queue.getProducerQueue(p).push(p * COUNT + i))
+					this_thread::yield();
+			}
+		});
+	}
+
+	vector<int> next(PRODUCERS);
+	for (int i = 0; i < PRODUCERS * COUNT; i++) {
+		int out;
+		queue.waitPop(out);
+		int p = out / COUNT;
+		ASSERT_EQ(out % COUNT, next[p]); // order is kept per producer
+		next[p]++;
+	}
+	for (auto& t : producers)
+		t.join();
+}
+
+class AdmissionQueueTest : public ::testing::Test {
+protected:
+	vector<common::BuildEvent> popAll() {
+		vector<common::BuildEvent> out;
+		common::BuildEvent event;
+		while (queue.tryPop(event))
+			out.push_back(event);
+		return out;
+	}
+
+	pipeline::Doorbell doorbell;
+	pipeline::AdmissionQueue<8> queue{doorbell, 4};
+};
+
+TEST_F(AdmissionQueueTest, brokenOvertakesFlood) {
+	for (int i = 0; i < 100; i++)
+		ASSERT_TRUE(queue.push(BuildResult::OK));
+	ASSERT_TRUE(queue.push(BuildResult::BROKEN));
+
+	auto out = popAll();
+	ASSERT_EQ(out.size(), 9u); // BROKEN, the newest 8
+	ASSERT_EQ(out[0].result, BuildResult::BROKEN);
+
+	// The older OKs of the same job do not turn the light green again.
+	pipeline::JobTable jobs{16};
+	for (auto& event : out)
+		jobs.update(event);
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::BROKEN);
+	ASSERT_EQ(jobs.getStaleCount(), 8u);
+
+	auto stats = queue.getStats();
+	ASSERT_EQ(stats.admitted, 101u);
+	ASSERT_EQ(stats.shedOverflow, 92u);
+	ASSERT_EQ(queue.getDroppedCount(), 92u);
+	ASSERT_TRUE(queue.empty());
+}
+
+TEST_F(AdmissionQueueTest, shedsDontKnowFirst) {
+	for (int i = 0; i < 10; i++)
+		queue.push(BuildResult::DONTKNOW);
+	ASSERT_TRUE(queue.push(BuildResult::OK));
+
+	auto out = popAll();
+	ASSERT_EQ(out.size(), 5u);
+	ASSERT_EQ(out.back().result, BuildResult::OK);
+	ASSERT_EQ(queue.getStats().shedDontKnow, 6u);
+}
+
+TEST_F(AdmissionQueueTest, fullBulkLaneDropsOldest) {
+	queue.push(BuildResult::DONTKNOW);
+	for (int i = 0; i < 10; i++)
+		queue.push(BuildResult::OK);
+
+	auto out = popAll();
+	ASSERT_EQ(out.size(), 8u);
+	for (size_t i = 0; i < 8; i++) {
+		ASSERT_EQ(out[i].result, BuildResult::OK);
+		ASSERT_EQ(out[i].sequence, out[0].sequence + i);
+	}
+	ASSERT_EQ(queue.getStats().shedDontKnow, 1u);
+	ASSERT_EQ(queue.getStats().shedOverflow, 2u);
+
+	// The last OK pushed came out.
+	queue.push(BuildResult::OK);
+	ASSERT_EQ(popAll()[0].sequence, out[7].sequence + 1);
+}
+
+TEST_F(AdmissionQueueTest, overflowingBrokenSurvivesOkOverflow) {
+	// Fills the priority lane and its overflow slot.
+	for (int i = 0; i < 17; i++)
+		ASSERT_TRUE(queue.push(BuildResult::BROKEN));
+	for (int i = 0; i < 100; i++)
+		ASSERT_TRUE(queue.push(BuildResult::OK));
+
+	auto out = popAll();
+	ASSERT_EQ(out.size(), 17u + 8u);
+	for (size_t i = 0; i < 17; i++)
+		ASSERT_EQ(out[i].result, BuildResult::BROKEN);
+	ASSERT_EQ(out[16].sequence, out[0].sequence + 16);
+	ASSERT_EQ(queue.getStats().shedBroken, 0u);
+
+	// Only a newer failure replaces one in the overflow slot.
+	for (int i = 0; i < 18; i++)
+		queue.push(BuildResult::BROKEN);
+	ASSERT_EQ(queue.getStats().shedBroken, 1u);
+	out = popAll();
+	ASSERT_EQ(out.size(), 17u);
+	ASSERT_EQ(out[16].sequence, out[15].sequence + 2);
+}
+
+TEST_F(AdmissionQueueTest, fansInWithFixedMemory) {
+	pipeline::FanInQueue<common::BuildEvent, 8, pipeline::AdmissionQueue<8>>
+		events{2};
+	for (int i = 0; i < 1000; i++)
+		events.getProducerQueue(0).push(BuildResult::OK);
+	events.getProducerQueue(1).push(BuildResult::BROKEN);
+
+	common::BuildEvent event;
+	vector<BuildResult> out;
+	while (events.tryPop(event))
+		out.push_back(event.result);
+	ASSERT_EQ(out.size(), 9u); // the newest 8 OKs, 1 BROKEN
+	ASSERT_EQ(count(out.begin(), out.end(), BuildResult::BROKEN), 1);
+	ASSERT_EQ(events.getDroppedCount(), 992u);
+}
+
+TEST_F(AdmissionQueueTest, lanesInterleaveWithoutLosingFailures) {
+	// Job A keeps failing while job B keeps passing, so each BROKEN of A is
+	// followed by a newer OK of B, which the consumer may pop first.
+	const uint64_t JOB_A{common::fingerprint("A")};
+	const uint64_t JOB_B{common::fingerprint("B")};
+	const size_t PAIRS{20000};
+	atomic<size_t> popped{0};
+
+	thread producer([&]() {
+		for (size_t i = 0; i < PAIRS; i++) {
+			// Never more in flight than the bulk lane holds, so nothing
+			// is shed for being full.
+			while (2 * i - popped.load() > 6)
+				this_thread::yield();
+			queue.push({BuildResult::BROKEN, JOB_A});
+			queue.push({BuildResult::OK, JOB_B});
+		}
+	});
+
+	pipeline::JobTable jobs{16};
+	size_t broken = 0;
+	common::BuildEvent event;
+	while (popped.load() < 2 * PAIRS) {
+		if (!queue.tryPop(event))
+			continue;
+		if (event.result == BuildResult::BROKEN)
+			broken++;
+		jobs.update(event);
+		popped.fetch_add(1);
+	}
+	producer.join();
+
+	ASSERT_EQ(broken, PAIRS);
+	ASSERT_EQ(queue.getDroppedCount(), 0u);
+	ASSERT_EQ(jobs.getStaleCount(), 0u);
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::BROKEN);
+}
+
+class JobTableTest : public ::testing::Test {
+protected:
+	const uint64_t JOB_A{common::fingerprint("A")};
+	const uint64_t JOB_B{common::fingerprint("B")};
+	chrono::steady_clock::time_point now;
+	pipeline::JobTable jobs{4096, [this]() { return now; }};
+};
+
+TEST_F(JobTableTest, greenJobDoesNotHideFailure) {
+	ASSERT_EQ(jobs.update({BuildResult::OK, JOB_A}).result, BuildResult::OK);
+	ASSERT_EQ(jobs.update({BuildResult::BROKEN, JOB_A}).result, BuildResult::BROKEN);
+	ASSERT_EQ(jobs.update({BuildResult::OK, JOB_B}).result, BuildResult::DONTKNOW);
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::BROKEN);
+
+	// Another failure of a broken job is signalled again.
+	ASSERT_EQ(jobs.update({BuildResult::BROKEN, JOB_A}).result, BuildResult::BROKEN);
+	ASSERT_EQ(jobs.getBrokenCount(), 1u);
+
+	ASSERT_EQ(jobs.update({BuildResult::OK, JOB_A}).result, BuildResult::OK);
+	ASSERT_EQ(jobs.getBrokenCount(), 0u);
+	ASSERT_EQ(jobs.getJobCount(), 2u);
+
+	BuildResult result;
+	ASSERT_TRUE(jobs.getResult(JOB_B, result));
+	ASSERT_EQ(result, BuildResult::OK);
+	ASSERT_FALSE(jobs.getResult(common::fingerprint("C"), result));
+}
+
+TEST_F(JobTableTest, ignoresStaleEvents) {
+	common::BuildEvent older{BuildResult::OK, JOB_A};
+	older.sequence = 1;
+	common::BuildEvent newer{BuildResult::BROKEN, JOB_A};
+	newer.sequence = 2;
+
+	jobs.update(newer);
+	ASSERT_EQ(jobs.update(older).result, BuildResult::DONTKNOW);
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::BROKEN);
+	ASSERT_EQ(jobs.getStaleCount(), 1u);
+}
+
+TEST_F(JobTableTest, comparesSequencesPerJob) {
+	common::BuildEvent passed{BuildResult::OK, JOB_B};
+	passed.sequence = 2;
+	common::BuildEvent failed{BuildResult::BROKEN, JOB_A};
+	failed.sequence = 1;
+
+	// The newer event of another job does not make the failure stale.
+	jobs.update(passed);
+	ASSERT_EQ(jobs.update(failed).result, BuildResult::BROKEN);
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::BROKEN);
+	ASSERT_EQ(jobs.getStaleCount(), 0u);
+}
+
+TEST_F(JobTableTest, thousandsOfJobs) {
+	for (int i = 0; i < 5000; i++) {
+		auto result = (i % 1000 == 0) ? BuildResult::BROKEN : BuildResult::OK;
+		jobs.update({result, common::fingerprint("job-" + to_string(i))});
+	}
+	ASSERT_EQ(jobs.getJobCount(), 4096u);
+	ASSERT_EQ(jobs.getUntrackedCount(), 5000u - 4096u);
+	ASSERT_EQ(jobs.getBrokenCount(), 5u);
+
+	for (int i = 0; i <= 4000; i += 1000)
+		jobs.update({BuildResult::OK, common::fingerprint("job-" + to_string(i))});
+	ASSERT_EQ(jobs.getAggregate(), BuildResult::OK);
+}
+
+TEST_F(JobTableTest, failureRateAndTimeToGreen) {
+	jobs.update({BuildResult::BROKEN, JOB_A});
+	now += chrono::seconds(60);
+	jobs.update({BuildResult::BROKEN, JOB_A});
+	now += chrono::seconds(60);
+	jobs.update({BuildResult::OK, JOB_A});
+
+	common::JobStatistics statistics;
+	ASSERT_TRUE(jobs.getJobStatistics(JOB_A, statistics));
+	ASSERT_EQ(statistics.builds, 3u);
+	ASSERT_EQ(statistics.windowBuilds, 3u);
+	ASSERT_EQ(statistics.windowFailures, 2u);
+	ASSERT_EQ(statistics.windowFlips, 1u);
+	ASSERT_NEAR(statistics.failureRate, 1.0 - pipeline::JobTable::DECAY, 1e-9);
+	ASSERT_TRUE(statistics.lastTimeToGreen == chrono::seconds(120));
+	ASSERT_TRUE(statistics.meanTimeToGreen == chrono::seconds(120));
+	ASSERT_FALSE(statistics.broken);
+	ASSERT_FALSE(jobs.getJobStatistics(JOB_B, statistics));
+}
+
+TEST_F(JobTableTest, flippingJobIsFlaky) {
+	for (int i = 0; i < 100; i++)
+		jobs.update({BuildResult::OK, JOB_B});
+	for (size_t i = 0; i < pipeline::JobTable::FLAKY_MIN_BUILDS; i++) {
+		jobs.update({(i % 2) ? BuildResult::OK : BuildResult::BROKEN, JOB_A});
+	}
+	ASSERT_EQ(jobs.getFlakyJobCount(), 1u);
+
+	common::JobStatistics statistics;
+	jobs.getJobStatistics(JOB_A, statistics);
+	ASSERT_TRUE(statistics.flaky);
+	jobs.getJobStatistics(JOB_B, statistics);
+	ASSERT_FALSE(statistics.flaky);
+	ASSERT_EQ(statistics.windowBuilds, common::JobStatistics::WINDOW_LEN);
+	ASSERT_EQ(statistics.windowFlips, 0u);
+
+	// Settles once it keeps passing.
+	for (int i = 0; i < 20; i++)
+		jobs.update({BuildResult::OK, JOB_A});
+	ASSERT_EQ(jobs.getFlakyJobCount(), 0u);
+}
+
+TEST_F(JobTableTest, flakinessIsSignalledWhileGreen) {
+	TestBeeper beeper;
+	TestRgbLight rgbLight;
+	Signalizer signalizer{beeper, rgbLight};
+	signalizer.setStatistics(&jobs);
+	pipeline::Coalescer coalescer{chrono::milliseconds(10), [this]() {
+		return now;
+	}};
+	auto build = [&](BuildResult result) {
+		coalescer.add(jobs.update({result, JOB_A}));
+		now += chrono::milliseconds(10);
+		coalescer.flush([&](BuildResult result) { signalizer.update(result); });
+	};
+	const LightSetting GREEN{0, 255, 0};
+	const LightSetting AMBER{255, 128, 0};
+
+	build(BuildResult::OK);
+	ASSERT_EQ(rgbLight.get(), GREEN);
+
+	// Turns flaky on a passing build after a passing one, so the aggregate
+	// stays OK.
+	for (int i = 0; i < 3; i++) {
+		build(BuildResult::BROKEN);
+		build(BuildResult::OK);
+	}
+	ASSERT_EQ(jobs.getFlakyJobCount(), 0u);
+	ASSERT_EQ(rgbLight.get(), GREEN);
+	build(BuildResult::OK);
+	ASSERT_EQ(jobs.getFlakyJobCount(), 1u);
+	ASSERT_EQ(rgbLight.get(), AMBER);
+
+	while (jobs.getFlakyJobCount() > 0) {
+		ASSERT_EQ(rgbLight.get(), AMBER);
+		build(BuildResult::OK);
+	}
+	ASSERT_EQ(rgbLight.get(), GREEN);
+}
+
+class DeduplicatorTest : public ::testing::Test {
+protected:
+	chrono::steady_clock::time_point now;
+	pipeline::Deduplicator deduplicator{8, chrono::milliseconds(100),
+		[this]() { return now; }};
+};
+
+TEST_F(DeduplicatorTest, dropsRetriesWithinWindow) {
+	ASSERT_TRUE(deduplicator.admit("{\"number\":1,\"status\":\"FAILURE\"}"));
+	ASSERT_TRUE(deduplicator.admit("{\"number\":2,\"status\":\"FAILURE\"}"));
+	now += chrono::milliseconds(99);
+	ASSERT_FALSE(deduplicator.admit("{\"number\":1,\"status\":\"FAILURE\"}"));
+
+	now += chrono::milliseconds(1);
+	ASSERT_TRUE(deduplicator.admit("{\"number\":1,\"status\":\"FAILURE\"}"));
+	ASSERT_EQ(deduplicator.getStats().duplicates, 1u);
+	ASSERT_EQ(deduplicator.getStats().received, 4u);
+}
+
+TEST_F(DeduplicatorTest, evictsOldestWhenFull) {
+	for (int i = 0; i < 8; i++) {
+		ASSERT_TRUE(deduplicator.admit(to_string(i)));
+		now += chrono::milliseconds(1);
+	}
+	ASSERT_TRUE(deduplicator.admit("8"));
+	ASSERT_EQ(deduplicator.getStats().evicted, 1u);
+	ASSERT_TRUE(deduplicator.admit("0")); // evicted before
+	ASSERT_FALSE(deduplicator.admit("8"));
+}
+
+class CoalescerTest : public ::testing::Test {
+protected:
+	void advance(int ms) {
+		now += chrono::milliseconds(ms);
+	}
+
+	void flushIfDue() {
+		if (coalescer.isDue())
+			coalescer.flush([this](BuildResult result) {
+				applied.push_back(result);
+			});
+	}
+
+	chrono::steady_clock::time_point now;
+	pipeline::Coalescer coalescer{chrono::milliseconds(10), [this]() {
+		return now;
+	}};
+	vector<BuildResult> applied;
+};
+
+TEST_F(CoalescerTest, appliesFinalStateAfterWindow) {
+	coalescer.add(BuildEvent{BuildResult::OK});
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(9);
+	flushIfDue();
+	ASSERT_TRUE(applied.empty());
+
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(1);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::OK));
+	ASSERT_FALSE(coalescer.isPending());
+	ASSERT_EQ(coalescer.getStats().received, 3u);
+	ASSERT_EQ(coalescer.getStats().applied, 1u);
+	ASSERT_EQ(coalescer.getStats().coalesced, 2u);
+}
+
+TEST_F(CoalescerTest, brokenIsNeverDropped) {
+	coalescer.add(BuildEvent{BuildResult::OK});
+	coalescer.add(BuildEvent{BuildResult::BROKEN});
+	coalescer.add(BuildEvent{BuildResult::BROKEN});
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(10);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::BROKEN, BuildResult::OK));
+	ASSERT_EQ(coalescer.getStats().coalesced, 2u);
+}
+
+TEST_F(CoalescerTest, unchangedStateIsNotReapplied) {
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(10);
+	flushIfDue();
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(10);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::OK));
+
+	coalescer.add(BuildEvent{BuildResult::BROKEN});
+	advance(10);
+	flushIfDue();
+	coalescer.add(BuildEvent{BuildResult::BROKEN});
+	advance(10);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::OK, BuildResult::BROKEN,
+				BuildResult::BROKEN));
+}
+
+TEST_F(CoalescerTest, changedStatisticsAreReapplied) {
+	BuildEvent changed{BuildResult::OK};
+	changed.statisticsChanged = true;
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(10);
+	flushIfDue();
+	coalescer.add(changed);
+	coalescer.add(BuildEvent{BuildResult::OK});
+	advance(10);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::OK, BuildResult::OK));
+
+	// But a failure is not signalled twice.
+	coalescer.add(changed);
+	coalescer.add(BuildEvent{BuildResult::BROKEN});
+	advance(10);
+	flushIfDue();
+	ASSERT_THAT(applied, ElementsAre(BuildResult::OK, BuildResult::OK,
+				BuildResult::BROKEN));
+}
+
+TEST_F(CoalescerTest, unknownResultsDoNotOpenWindow) {
+	coalescer.add(BuildEvent{BuildResult::DONTKNOW});
+	ASSERT_FALSE(coalescer.isPending());
+	ASSERT_EQ(coalescer.getStats().coalesced, 1u);
+}
+
 class TestKeyValueStore : public KeyValueStore {
 public:
 	void set(const std::string& key, const std::string& value) override {
@@ -386,6 +1245,150 @@ TEST_F(PwmBeeperTest, updatesDutyCycleTogetherWithFrequencyDependingOnVolume) {
 	beeper.playTone(tone);
 }
 
+class ToneSequencerTest : public ::testing::Test {
+protected:
+	/**
+	 * Records the periods of the tones started. While held, starting a tone
+	 * blocks the sequencer thread until release().
+	 */
+	class RecordingPwmOutput : public pwm::PwmOutput {
+	public:
+		void enable(bool en) override {
+			std::lock_guard<std::mutex> lock(mutex);
+			enabled = en;
+		}
+
+		void setPeriodNs(unsigned long int value) override {
+			std::unique_lock<std::mutex> lock(mutex);
+			released.wait(lock, [&]() { return !held; });
+			periods.push_back(value);
+		}
+
+		void hold() {
+			std::lock_guard<std::mutex> lock(mutex);
+			held = true;
+		}
+
+		void release() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				held = false;
+			}
+			released.notify_all();
+		}
+
+		void setDutyCycleNs(unsigned long int) override {
+		}
+
+		vector<unsigned long> getPeriods() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return periods;
+		}
+
+		bool isEnabled() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return enabled;
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable released;
+		vector<unsigned long> periods;
+		bool enabled{false};
+		bool held{false};
+	};
+
+	RecordingPwmOutput pwmOutput;
+	pwm::ToneSequencer sequencer{pwmOutput};
+};
+
+TEST_F(ToneSequencerTest, playsSequenceWithoutBlocking) {
+	pwmOutput.hold();
+	sequencer.play({{20, 1000}, {10, 0}, {20, 2000}});
+	ASSERT_TRUE(pwmOutput.getPeriods().empty());
+
+	pwmOutput.release();
+	sequencer.waitIdle();
+	ASSERT_THAT(pwmOutput.getPeriods(), ElementsAre(1000000, 500000));
+	ASSERT_FALSE(pwmOutput.isEnabled());
+
+	auto stats = sequencer.getStats();
+	ASSERT_EQ(stats.sequences, 1u);
+	ASSERT_EQ(stats.deadlines, 3u);
+	ASSERT_TRUE(stats.maxJitter >= chrono::nanoseconds(0));
+	ASSERT_TRUE(stats.totalJitter >= stats.maxJitter);
+}
+
+TEST_F(ToneSequencerTest, newSequencePreempts) {
+	sequencer.playTone({10000, 1000});
+	while (!pwmOutput.isEnabled())
+		this_thread::sleep_for(chrono::milliseconds(1));
+
+	sequencer.play({{1, 2000}});
+	sequencer.waitIdle();
+
+	ASSERT_THAT(pwmOutput.getPeriods(), ElementsAre(1000000, 500000));
+	ASSERT_FALSE(pwmOutput.isEnabled());
+	auto stats = sequencer.getStats();
+	ASSERT_EQ(stats.sequences, 2u);
+	ASSERT_EQ(stats.preempted, 1u);
+}
+
+class LedAnimatorTest : public ::testing::Test {
+protected:
+	class RecordingRgbLight : public RgbLight {
+	public:
+		void set(LightSetting value) override {
+			std::lock_guard<std::mutex> lock(mutex);
+			frames.push_back(value);
+		}
+
+		LightSetting get() override {
+			std::lock_guard<std::mutex> lock(mutex);
+			return frames.empty() ? LightSetting{} : frames.back();
+		}
+
+		vector<LightSetting> getFrames() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return frames;
+		}
+
+	private:
+		std::mutex mutex;
+		vector<LightSetting> frames;
+	};
+
+	RecordingRgbLight led;
+	animation::LedAnimator animator{led, chrono::milliseconds(100)};
+};
+
+TEST_F(LedAnimatorTest, crossFades) {
+	animator.set(common::RED);
+	ASSERT_EQ(animator.get(), common::RED);
+	animator.waitIdle();
+
+	auto frames = led.getFrames();
+	ASSERT_EQ(frames.back(), common::RED);
+	for (size_t i = 1; i < frames.size(); i++) {
+		ASSERT_GT(frames[i].r, frames[i - 1].r);
+		ASSERT_EQ(frames[i].g, 0);
+	}
+	auto stats = animator.getStats();
+	ASSERT_EQ(stats.framesPushed, frames.size());
+	ASSERT_LE(stats.framesPushed, stats.ticks + 1);
+}
+
+TEST_F(LedAnimatorTest, pushesOnlyChangedFrames) {
+	animator.set(common::RED);
+	animator.waitIdle();
+	size_t pushed = led.getFrames().size();
+
+	animator.set(common::RED);
+	animator.waitIdle();
+	ASSERT_EQ(led.getFrames().size(), pushed);
+	ASSERT_EQ(animator.getStats().framesPushed, pushed);
+}
+
 class PwmRgbLedTest : public ::testing::Test {
 protected:
 	void SetUp() override {
@@ -426,20 +1429,69 @@ TEST_F(PwmRgbLedTest, appliesDefaultsOnConstruction) {
 TEST_F(PwmRgbLedTest, configurationHappensInTheRightOrder) {
 	::testing::InSequence inSeq;
 	EXPECT_CALL(pwmOutputs[0], setPeriodNs(_));
-	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(_));
-	EXPECT_CALL(pwmOutputs[0], enable(true));
-
 	EXPECT_CALL(pwmOutputs[1], setPeriodNs(_));
-	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(_));
+	EXPECT_CALL(pwmOutputs[2], setPeriodNs(_));
+
+	EXPECT_CALL(pwmOutputs[0], enable(true));
 	EXPECT_CALL(pwmOutputs[1], enable(true));
+	EXPECT_CALL(pwmOutputs[2], enable(true));
 
-	EXPECT_CALL(pwmOutputs[2], setPeriodNs(_));
+	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(_));
+	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(_));
 	EXPECT_CALL(pwmOutputs[2], setDutyCycleNs(_));
-	EXPECT_CALL(pwmOutputs[2], enable(true));
 
 	led.set(anySetting);
 }
 
+TEST_F(PwmRgbLedTest, laterCommitsOnlyWriteChangedDutyCycles) {
+	led.set(LightSetting{255, 0, 0});
+
+	EXPECT_CALL(pwmOutputs[0], setPeriodNs(_)).Times(0);
+	EXPECT_CALL(pwmOutputs[0], enable(_)).Times(0);
+	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(_)).Times(0);
+	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(_)).Times(0);
+	EXPECT_CALL(pwmOutputs[2], setDutyCycleNs(_));
+	led.set(LightSetting{255, 0, 255});
+}
+
+TEST_F(PwmRgbLedTest, dimmingChannelsAreWrittenFirst) {
+	led.set(LightSetting{0, 0, 255});
+
+	::testing::InSequence inSeq;
+	EXPECT_CALL(pwmOutputs[2], setDutyCycleNs(0));
+	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(Gt(0ul)));
+	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(Gt(0ul)));
+	led.set(LightSetting{255, 255, 0});
+}
+
+TEST_F(PwmRgbLedTest, stagedSettingIsWrittenOnCommit) {
+	led.set(LightSetting{255, 0, 0});
+
+	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(_)).Times(0);
+	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(_)).Times(0);
+	led.stage(LightSetting{0, 255, 0});
+	ASSERT_EQ(led.get(), (LightSetting{255, 0, 0}));
+	Mock::VerifyAndClearExpectations(&pwmOutputs[0]);
+	Mock::VerifyAndClearExpectations(&pwmOutputs[1]);
+
+	EXPECT_CALL(pwmOutputs[0], setDutyCycleNs(0));
+	EXPECT_CALL(pwmOutputs[1], setDutyCycleNs(Gt(0ul)));
+	led.commit();
+	ASSERT_EQ(led.get(), (LightSetting{0, 255, 0}));
+}
+
+TEST_F(PwmRgbLedTest, countsCommits) {
+	led.set(LightSetting{255, 0, 0});
+	led.set(LightSetting{0, 255, 0});
+	led.set(LightSetting{0, 255, 0});
+
+	auto stats = led.getStats();
+	ASSERT_EQ(stats.commits, 3);
+	ASSERT_EQ(stats.dutyCyclesWritten, 3);
+	ASSERT_LE(stats.lastSettleTime, stats.maxSettleTime);
+	ASSERT_LE(stats.maxSettleTime, stats.totalSettleTime);
+}
+
 TEST_F(PwmRgbLedTest, pwmPeriodIsConstant) {
 	EXPECT_CALL(pwmOutputs[0], setPeriodNs(led.getDefaultPeriodNs()));
 	EXPECT_CALL(pwmOutputs[1], setPeriodNs(led.getDefaultPeriodNs()));
@@ -461,6 +1513,42 @@ TEST_F(PwmRgbLedTest, dutyCycleIsSetInRelationToPeriodButLimited) {
 	ASSERT_NEAR(lastDutyCycle[2], pwm::PwmRgbLed::DUTY_CYCLE_MAX_RATIO * 1 * led.getDefaultPeriodNs(), delta);
 }
 
+/**
+ * Fixed gains, independent of the device calibration.
+ */
+struct TestCalibration {
+	static constexpr double GAMMA{2.2};
+	static constexpr double GAIN_RED{1.0};
+	static constexpr double GAIN_GREEN{0.5};
+	static constexpr double GAIN_BLUE{1.0};
+};
+
+TEST(DutyCycleTableTest, gammaCorrected) {
+	using Led = pwm::BasicPwmRgbLed<TestCalibration>;
+	static_assert(Led::DUTY_CYCLES.ns[0][0] == 0, "off is off");
+	static_assert(Led::DUTY_CYCLES.ns[2][255] ==
+			(unsigned long)(Led::DEFAULT_PERIOD_NS * Led::DUTY_CYCLE_MAX_RATIO),
+			"full is limited");
+
+	// Half the value is about a fifth of the light, scaled by the gain.
+	double half = Led::DUTY_CYCLES.ns[1][128] /
+		(Led::DEFAULT_PERIOD_NS * Led::DUTY_CYCLE_MAX_RATIO);
+	ASSERT_NEAR(half, 0.5 * pow(128 / 255.0, 2.2), 0.001);
+	for (int i = 1; i < 256; i++)
+		ASSERT_GE(Led::DUTY_CYCLES.ns[0][i], Led::DUTY_CYCLES.ns[0][i - 1]);
+}
+
+TEST(DutyCycleTableTest, deviceCalibrationIsMonotonic) {
+	using Led = pwm::BasicPwmRgbLed<pwm::GammaCalibration>;
+	for (int channel = 0; channel < 3; channel++) {
+		ASSERT_EQ(Led::DUTY_CYCLES.ns[channel][0], 0ul);
+		ASSERT_LE(Led::DUTY_CYCLES.ns[channel][255],
+				(unsigned long)(Led::DEFAULT_PERIOD_NS * Led::DUTY_CYCLE_MAX_RATIO));
+		for (int i = 1; i < 256; i++)
+			ASSERT_GE(Led::DUTY_CYCLES.ns[channel][i], Led::DUTY_CYCLES.ns[channel][i - 1]);
+	}
+}
+
 TEST_F(PwmRgbLedTest, lightSettingIsBuffered) {
 	auto in = LightSetting{255, 127, 63};
 	led.set(in);
@@ -474,6 +1562,315 @@ TEST_F(PwmRgbLedTest, defaultSetting) {
 	ASSERT_EQ(out, expected);
 }
 
+class LinuxPwmOutputTest : public ::testing::Test {
+protected:
+	string readProperty(const string& name) {
+		return sysfs.read(1, 0, name);
+	}
+
+	FakePwmTree sysfs{2};
+	pwm::LinuxPwmOutput pwmOutput{sysfs.getBasePath(), 1, 0};
+};
+
+TEST_F(LinuxPwmOutputTest, exportsAndResetsOnConstruction) {
+	ASSERT_EQ(readProperty("period"), "0");
+	ASSERT_EQ(readProperty("duty_cycle"), "0");
+	ASSERT_EQ(readProperty("enable"), "0");
+}
+
+TEST_F(LinuxPwmOutputTest, writesProperties) {
+	pwmOutput.setPeriodNs(70000);
+	pwmOutput.setDutyCycleNs(56000);
+	pwmOutput.enable(true);
+	ASSERT_EQ(readProperty("period"), "70000");
+	ASSERT_EQ(readProperty("duty_cycle"), "56000");
+	ASSERT_EQ(readProperty("enable"), "1");
+
+	pwmOutput.setDutyCycleNs(5);
+	pwmOutput.setPeriodNs(ULONG_MAX);
+	ASSERT_EQ(readProperty("duty_cycle"), "5");
+	ASSERT_EQ(readProperty("period"), to_string(ULONG_MAX));
+}
+
+TEST_F(LinuxPwmOutputTest, elidesUnchangedWrites) {
+	auto before = pwmOutput.getStats();
+	pwmOutput.setPeriodNs(70000);
+	pwmOutput.setPeriodNs(70000);
+	pwmOutput.enable(false);
+	auto after = pwmOutput.getStats();
+	ASSERT_EQ(after.written - before.written, 1u);
+	ASSERT_EQ(after.elided - before.elided, 2u);
+}
+
+TEST_F(LinuxPwmOutputTest, resyncRestoresDriftedState) {
+	pwmOutput.setDutyCycleNs(56000);
+	ofstream(sysfs.getBasePath() + "/pwmchip1/pwm0/duty_cycle") << "0\n";
+
+	pwmOutput.setDutyCycleNs(56000);
+	ASSERT_EQ(readProperty("duty_cycle"), "0");
+	pwmOutput.resync();
+	ASSERT_EQ(readProperty("duty_cycle"), "56000");
+}
+
+class AsyncPwmOutputTest : public ::testing::Test {
+protected:
+	/**
+	 * Records writes; blocks in each while held.
+	 */
+	class SlowPwmOutput : public pwm::PwmOutput {
+	public:
+		void enable(bool en) override {
+			record("enable", en);
+		}
+
+		void setPeriodNs(unsigned long int value) override {
+			record("period", value);
+		}
+
+		void setDutyCycleNs(unsigned long int value) override {
+			record("duty_cycle", value);
+		}
+
+		void release() {
+			std::lock_guard<std::mutex> lock(mutex);
+			held = false;
+			released.notify_all();
+		}
+
+		void waitForWrites(size_t count) {
+			std::unique_lock<std::mutex> lock(mutex);
+			released.wait(lock, [&]() { return writes.size() >= count; });
+		}
+
+		vector<string> writes;
+		bool held{false};
+
+	private:
+		void record(const string& name, unsigned long value) {
+			std::unique_lock<std::mutex> lock(mutex);
+			writes.push_back(name + "=" + to_string(value));
+			released.notify_all();
+			released.wait(lock, [&]() { return !held; });
+		}
+
+		std::mutex mutex;
+		std::condition_variable released;
+	};
+
+	SlowPwmOutput slow;
+	pwm::PwmWorker worker;
+	pwm::AsyncPwmOutput output{slow, worker};
+};
+
+TEST_F(AsyncPwmOutputTest, mergesSupersededUpdates) {
+	slow.held = true;
+	output.enable(true);
+	slow.waitForWrites(1);
+
+	for (unsigned long i = 1; i <= 100; i++)
+		output.setDutyCycleNs(i);
+	output.enable(false);
+	slow.release();
+	output.flush();
+
+	ASSERT_THAT(slow.writes, ElementsAre("enable=1", "duty_cycle=100", "enable=0"));
+	ASSERT_EQ(worker.getStats().submitted, 102u);
+	ASSERT_EQ(worker.getStats().merged, 99u);
+}
+
+TEST_F(AsyncPwmOutputTest, shrinkingPeriodWritesDutyCycleFirst) {
+	output.setPeriodNs(1000);
+	output.setDutyCycleNs(800);
+	output.flush();
+
+	// Held, so that the updates are pending together.
+	slow.held = true;
+	output.enable(false);
+	slow.waitForWrites(3);
+	output.setPeriodNs(500);
+	output.setDutyCycleNs(400);
+	output.enable(true);
+	slow.release();
+	output.flush();
+
+	ASSERT_THAT(slow.writes, ElementsAre("period=1000", "duty_cycle=800",
+				"enable=0", "duty_cycle=400", "period=500", "enable=1"));
+}
+
+TEST_F(AsyncPwmOutputTest, colourChangesThroughWorker) {
+	array<pwm::AsyncPwmOutput, 3> outputs{{{slow, worker}, {slow, worker}, {slow, worker}}};
+	pwm::PwmRgbLed led{outputs[0], outputs[1], outputs[2]};
+	led.set(LightSetting{255, 0, 0});
+	worker.flush();
+	ASSERT_EQ(count(slow.writes.begin(), slow.writes.end(), "enable=1"), 3);
+	ASSERT_EQ(count(slow.writes.begin(), slow.writes.end(), "duty_cycle=56000"), 1);
+}
+
+TEST_F(AsyncPwmOutputTest, dimmingOutputsAreWrittenFirst) {
+	array<pwm::AsyncPwmOutput, 3> outputs{{{slow, worker}, {slow, worker}, {slow, worker}}};
+	pwm::PwmRgbLed led{outputs[0], outputs[1], outputs[2]};
+	led.set(common::RED);
+	worker.flush();
+	size_t before = slow.writes.size();
+
+	// Held, so that red to yellow merges with yellow to green, queueing the
+	// brightening green before the dimming red.
+	slow.held = true;
+	output.enable(true);
+	slow.waitForWrites(before + 1);
+	led.set(LightSetting{255, 255, 0});
+	led.set(common::GREEN);
+	slow.release();
+	worker.flush();
+
+	ASSERT_THAT(vector<string>(slow.writes.begin() + before + 1, slow.writes.end()),
+			ElementsAre("duty_cycle=0", "duty_cycle=56000"));
+}
+
+class PixelStripTest : public ::testing::Test {
+protected:
+	class RecordingPixelSink : public pixels::PixelSink {
+	public:
+		void write(size_t first, size_t count, const uint8_t* r,
+				const uint8_t* g, const uint8_t* b) override {
+			ranges.push_back({first, count});
+			for (size_t i = first; i < first + count; i++)
+				shown[i] = LightSetting{r[i], g[i], b[i]};
+		}
+
+		vector<pair<size_t, size_t>> ranges;
+		map<size_t, LightSetting> shown;
+	};
+
+	RecordingPixelSink sink;
+	pixels::PixelStrip strip{300, sink};
+};
+
+TEST_F(PixelStripTest, flushesDirtyRangeOnly) {
+	ASSERT_FALSE(strip.flush());
+
+	strip.set(10, common::RED);
+	strip.set(20, common::GREEN);
+	strip.set(15, LightSetting{}); // unchanged
+	ASSERT_TRUE(strip.flush());
+	ASSERT_THAT(sink.ranges, ElementsAre(make_pair<size_t, size_t>(10, 11)));
+	ASSERT_EQ(sink.shown[10], common::RED);
+	ASSERT_EQ(sink.shown[20], common::GREEN);
+
+	// Set back to what is shown: nothing to flush.
+	strip.set(5, common::RED);
+	strip.set(5, LightSetting{});
+	strip.set(20, common::GREEN);
+	ASSERT_FALSE(strip.flush());
+	ASSERT_EQ(strip.get(20), common::GREEN);
+}
+
+TEST_F(PixelStripTest, fillTrimsToChangedPixels) {
+	strip.set(0, common::RED);
+	strip.set(299, common::RED);
+	strip.flush();
+
+	strip.fill(common::RED);
+	strip.set(0, LightSetting{});
+	strip.flush();
+	ASSERT_EQ(sink.ranges.back(), (make_pair<size_t, size_t>(0, 299)));
+	ASSERT_EQ(strip.getStats().pixelsWritten, 300u + 299u);
+}
+
+TEST_F(PixelStripTest, ignoresPixelsBeyondStrip) {
+	strip.set(300, common::RED);
+	ASSERT_FALSE(strip.flush());
+	ASSERT_EQ(strip.get(300), LightSetting{});
+}
+
+TEST_F(PixelStripTest, setsOnlyChangedLights) {
+	class CountingRgbLight : public TestRgbLight {
+	public:
+		void set(LightSetting value) override {
+			setCount++;
+			TestRgbLight::set(value);
+		}
+
+		size_t setCount{0};
+	};
+
+	CountingRgbLight lights[3];
+	pixels::RgbLightSink lightSink{{&lights[0], &lights[1], &lights[2]}};
+	pixels::PixelStrip lightStrip{3, lightSink};
+
+	lightStrip.set(0, common::RED);
+	lightStrip.set(2, common::GREEN);
+	lightStrip.flush();
+	ASSERT_EQ(lights[0].get(), common::RED);
+	ASSERT_EQ(lights[1].get(), LightSetting{});
+	ASSERT_EQ(lights[2].get(), common::GREEN);
+	ASSERT_EQ(lights[0].setCount, 1u);
+	ASSERT_EQ(lights[1].setCount, 0u);
+	ASSERT_EQ(lights[2].setCount, 1u);
+
+	lightStrip.set(1, common::RED);
+	lightStrip.flush();
+	ASSERT_EQ(lights[1].get(), common::RED);
+	ASSERT_EQ(lights[0].setCount, 1u);
+	ASSERT_EQ(lights[1].setCount, 1u);
+	ASSERT_EQ(lights[2].setCount, 1u);
+}
+
+TEST_F(PixelStripTest, byteSinkWritesChangedBytesOfFiles) {
+	char path[] = "/tmp/ciSpy-pixels-XXXXXX";
+	close(mkstemp(path));
+	{
+		pixels::ByteSink byteSink{path, 4};
+		pixels::PixelStrip fileStrip{4, byteSink};
+		fileStrip.fill(LightSetting{1, 2, 3});
+		fileStrip.flush();
+		fileStrip.set(2, LightSetting{7, 8, 9});
+		fileStrip.flush();
+	}
+
+	ifstream in(path);
+	string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	unlink(path);
+	ASSERT_EQ(bytes, string("\1\2\3\1\2\3\7\10\11\1\2\3", 12));
+}
+
+TEST_F(PixelStripTest, byteSinkRejectsPixelsBeyondFrame) {
+	char path[] = "/tmp/ciSpy-pixels-XXXXXX";
+	close(mkstemp(path));
+	{
+		pixels::ByteSink byteSink{path, 2};
+		pixels::PixelStrip fileStrip{4, byteSink};
+		fileStrip.set(1, LightSetting{1, 2, 3});
+		fileStrip.set(2, LightSetting{7, 8, 9});
+		fileStrip.flush();
+		fileStrip.set(0, LightSetting{4, 5, 6});
+		fileStrip.flush();
+	}
+
+	ifstream in(path);
+	string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	unlink(path);
+	ASSERT_EQ(bytes, string("\4\5\6", 3));
+}
+
+TEST_F(PixelStripTest, byteSinkWritesWholeFramesToFifos) {
+	string path = "/tmp/ciSpy-pixels-" + to_string(getpid());
+	ASSERT_EQ(mkfifo(path.c_str(), 0600), 0);
+	int reader = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+	{
+		pixels::ByteSink byteSink{path, 4};
+		pixels::PixelStrip fifoStrip{4, byteSink};
+		fifoStrip.set(3, LightSetting{7, 8, 9});
+		fifoStrip.flush();
+	}
+
+	char bytes[32];
+	ASSERT_EQ(read(reader, bytes, sizeof(bytes)), 12);
+	ASSERT_EQ(string(bytes, 12), string("\0\0\0\0\0\0\0\0\0\7\10\11", 12));
+	close(reader);
+	unlink(path.c_str());
+}
+
 class TestStreamFactory : public filesystem::StreamFactory {
 public:
 	std::unique_ptr<std::istream> makeInputStream(const std::string& path) {
@@ -542,4 +1939,506 @@ TEST_F(FileStoreTest, setValueForExistingKey) {
 	ASSERT_EQ(streamFactory.outStringBuf, "key0:bar\nkey1:value1\nkey2:value2\n");
 }
 
+class StringViewTest : public ::testing::Test {
+};
+
+TEST_F(StringViewTest, findAndCompare) {
+	string str{"<status>FAILURE</status>"};
+	StringView view{str};
+	ASSERT_EQ(view.size(), str.size());
+	ASSERT_EQ(view.find('>'), 7u);
+	ASSERT_EQ(view.find("FAILURE"), 8u);
+	ASSERT_EQ(view.find("SUCCESS"), StringView::npos);
+	ASSERT_EQ(view.substr(8, 7), "FAILURE");
+	ASSERT_TRUE(view.startsWith("<status>"));
+	ASSERT_NE(view, "<status>");
+}
+
+class MessageAssemblerTest : public ::testing::Test {
+protected:
+	void feed(network::MessageAssembler& assembler, const string& data) {
+		assembler.append(data.data(), data.size());
+		assembler.extract(handler);
+	}
+
+	vector<string> received;
+	network::MessageAssembler::MessageHandler handler{[this](StringView msg) {
+		received.push_back(msg.toString());
+	}};
+	network::BufferPool pool{8};
+};
+
+TEST_F(MessageAssemblerTest, untilEofSpansChunks) {
+	network::MessageAssembler assembler{pool, network::Framing::UNTIL_EOF};
+	string large(3 * network::BufferPool::CHUNK_SIZE + 10, 'x');
+	feed(assembler, large);
+	ASSERT_TRUE(received.empty());
+
+	assembler.finish(handler);
+	ASSERT_THAT(received, ElementsAre(large));
+}
+
+TEST_F(MessageAssemblerTest, delimitedPartialReads) {
+	network::MessageAssembler assembler{pool, network::Framing::DELIMITED};
+	feed(assembler, "SUCC");
+	feed(assembler, "ESS\nFAIL");
+	ASSERT_THAT(received, ElementsAre("SUCCESS"));
+
+	feed(assembler, "URE\n\nrest");
+	assembler.finish(handler);
+	ASSERT_THAT(received, ElementsAre("SUCCESS", "FAILURE", "", "rest"));
+}
+
+TEST_F(MessageAssemblerTest, delimiterAcrossChunkBoundary) {
+	network::MessageAssembler assembler{pool, network::Framing::DELIMITED};
+	string first(network::BufferPool::CHUNK_SIZE - 2, 'a');
+	feed(assembler, first + "\nbb");
+	feed(assembler, "b\n");
+	ASSERT_THAT(received, ElementsAre(first, "bbb"));
+	ASSERT_EQ(assembler.size(), 0u);
+}
+
+TEST_F(MessageAssemblerTest, lengthPrefixed) {
+	network::MessageAssembler assembler{pool, network::Framing::LENGTH_PREFIXED};
+	feed(assembler, string("\0\0\0\x03", 4) + "abc" + string("\0\0", 2));
+	ASSERT_THAT(received, ElementsAre("abc"));
+
+	feed(assembler, string("\0\x02", 2) + "d");
+	feed(assembler, "e");
+	ASSERT_THAT(received, ElementsAre("abc", "de"));
+
+	// truncated message is discarded
+	feed(assembler, string("\0\0\0\x09", 4) + "xyz");
+	assembler.finish(handler);
+	ASSERT_EQ(received.size(), 2u);
+}
+
+TEST_F(MessageAssemblerTest, chunksAreRecycled) {
+	network::MessageAssembler assembler{pool, network::Framing::DELIMITED};
+	for (int i = 0; i < 100; i++)
+		feed(assembler, "SUCCESS\n");
+	ASSERT_EQ(received.size(), 100u);
+	ASSERT_EQ(pool.getAllocatedCount(), 1u);
+}
+
+class HttpRequestParserTest : public ::testing::Test {
+protected:
+	using Result = network::HttpRequestParser::Result;
+
+	/**
+	 * Feeds the input in pieces of the given size, collects the body and
+	 * returns the last result.
+	 */
+	Result feed(const string& input, size_t pieceSize = 1000) {
+		Result result = Result::INCOMPLETE;
+		for (size_t pos = 0; pos < input.size(); pos += pieceSize) {
+			const char* data = input.data() + pos;
+			const char* end = data + min(pieceSize, input.size() - pos);
+			while (1) {
+				StringView piece;
+				result = parser.parse(data, end, piece);
+				if (result == Result::BODY)
+					body.append(piece.data(), piece.size());
+				else if (result != Result::HEADERS_COMPLETE)
+					break;
+			}
+			if (result == Result::COMPLETE || result == Result::ERROR)
+				break;
+		}
+		return result;
+	}
+
+	network::HttpRequestParser parser;
+	string body;
+};
+
+TEST_F(HttpRequestParserTest, contentLengthBodyInSingleBytes) {
+	auto result = feed("POST /jenkins HTTP/1.1\r\nHost: x\r\n"
+			"Content-Length: 7\r\n\r\nSUCCESS", 1);
+	ASSERT_EQ(result, Result::COMPLETE);
+	ASSERT_EQ(body, "SUCCESS");
+	ASSERT_TRUE(parser.isKeepAlive());
+}
+
+TEST_F(HttpRequestParserTest, chunkedBody) {
+	auto result = feed("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+			"4;ext=1\r\nSUCC\r\n3\r\nESS\r\n0\r\nTrailer: x\r\n\r\n", 3);
+	ASSERT_EQ(result, Result::COMPLETE);
+	ASSERT_TRUE(parser.isChunked());
+	ASSERT_EQ(body, "SUCCESS");
+}
+
+TEST_F(HttpRequestParserTest, connectionClose) {
+	feed("POST / HTTP/1.1\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+	ASSERT_FALSE(parser.isKeepAlive());
+
+	parser.reset();
+	feed("POST / HTTP/1.0\r\n\r\n");
+	ASSERT_FALSE(parser.isKeepAlive());
+
+	parser.reset();
+	feed("POST / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n");
+	ASSERT_TRUE(parser.isKeepAlive());
+}
+
+TEST_F(HttpRequestParserTest, pipelinedRequests) {
+	string input{"POST / HTTP/1.1\r\nContent-Length: 2\r\n\r\nabPOST / HTTP/1.1\r\n"
+			"Content-Length: 2\r\n\r\ncd"};
+	const char* data = input.data();
+	const char* end = data + input.size();
+	StringView piece;
+	while (parser.parse(data, end, piece) != Result::COMPLETE)
+		;
+	parser.reset();
+	while (parser.parse(data, end, piece) != Result::COMPLETE)
+		;
+	ASSERT_EQ(piece, "cd");
+	ASSERT_EQ(data, end);
+}
+
+TEST_F(HttpRequestParserTest, malformedRequests) {
+	ASSERT_EQ(feed("POST / HTTP/2\r\n\r\n"), Result::ERROR);
+
+	parser.reset();
+	ASSERT_EQ(feed("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n"), Result::ERROR);
+
+	parser.reset();
+	ASSERT_EQ(feed("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+				"xyz\r\n"), Result::ERROR);
+
+	parser.reset();
+	ASSERT_EQ(feed("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n"), Result::ERROR);
+}
+
+TEST_F(HttpRequestParserTest, detectsRequestStart) {
+	ASSERT_TRUE(network::HttpRequestParser::isRequestStart("POST /job HTTP/1.1"));
+	ASSERT_FALSE(network::HttpRequestParser::isRequestStart("{\"name\":\"POST"));
+}
+
+int connectToLocalPort(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+class EpollTcpServerTest : public ::testing::Test {
+protected:
+	void pollUntilReceived(size_t count) {
+		for (int i = 0; i < 100 && received.size() < count; i++)
+			server.poll(10);
+	}
+
+	vector<string> received;
+	network::EpollTcpServer server{0, [this](StringView msg) {
+		received.push_back(msg.toString());
+	}};
+};
+
+TEST_F(EpollTcpServerTest, receivesMessageWhenClientCloses) {
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, "SUCC", 4, 0), 4);
+	server.poll(10);
+	ASSERT_EQ(send(fd, "ESS", 3, 0), 3);
+	close(fd);
+
+	pollUntilReceived(1);
+	ASSERT_THAT(received, ElementsAre("SUCCESS"));
+	ASSERT_EQ(server.getOpenConnections(), 0u);
+}
+
+TEST_F(EpollTcpServerTest, receivesMessageLargerThanChunk) {
+	string large(3 * network::BufferPool::CHUNK_SIZE + 10, 'x');
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, large.data(), large.size(), 0), (ssize_t)large.size());
+	close(fd);
+
+	pollUntilReceived(1);
+	ASSERT_THAT(received, ElementsAre(large));
+}
+
+TEST_F(EpollTcpServerTest, multiplexesConcurrentClients) {
+	const size_t CLIENTS{50};
+	vector<int> fds;
+	for (size_t i = 0; i < CLIENTS; i++) {
+		int fd = connectToLocalPort(server.getPort());
+		ASSERT_NE(fd, -1);
+		fds.push_back(fd);
+	}
+
+	for (size_t i = 0; i < CLIENTS; i++) {
+		auto msg = to_string(i);
+		ASSERT_EQ(send(fds[i], msg.c_str(), msg.size(), 0), (ssize_t)msg.size());
+		close(fds[i]);
+	}
+
+	pollUntilReceived(CLIENTS);
+	ASSERT_EQ(received.size(), CLIENTS);
+	ASSERT_EQ(server.getOpenConnections(), 0u);
+}
+
+TEST_F(EpollTcpServerTest, httpKeepAlive) {
+	network::EpollTcpServer httpServer{0, [this](StringView msg) {
+		received.push_back(msg.toString());
+	}, network::Framing::HTTP};
+
+	int fd = connectToLocalPort(httpServer.getPort());
+	ASSERT_NE(fd, -1);
+
+	string request{"POST / HTTP/1.1\r\nContent-Length: 7\r\n\r\nSUCCESS"};
+	string response;
+	char buf[256];
+	for (int i = 0; i < 2; i++) {
+		ASSERT_EQ(send(fd, request.data(), request.size(), 0), (ssize_t)request.size());
+		for (int j = 0; j < 100 && response.size() < (i + 1) * network::HTTP_RESPONSE_OK.size(); j++) {
+			httpServer.poll(10);
+			ssize_t size = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (size > 0)
+				response.append(buf, size);
+		}
+	}
+	close(fd);
+
+	ASSERT_THAT(received, ElementsAre("SUCCESS", "SUCCESS"));
+	ASSERT_EQ(response, network::HTTP_RESPONSE_OK.toString() + network::HTTP_RESPONSE_OK.toString());
+}
+
+TEST_F(EpollTcpServerTest, rawMessageOnHttpPort) {
+	network::EpollTcpServer httpServer{0, [this](StringView msg) {
+		received.push_back(msg.toString());
+	}, network::Framing::HTTP};
+
+	int fd = connectToLocalPort(httpServer.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, "FAILURE", 7, 0), 7);
+	close(fd);
+
+	for (int i = 0; i < 100 && received.empty(); i++)
+		httpServer.poll(10);
+	ASSERT_THAT(received, ElementsAre("FAILURE"));
+}
+
+TEST_F(EpollTcpServerTest, reusePortAcceptors) {
+	network::EpollTcpServer first{0, [this](StringView msg) {
+		received.push_back(msg.toString());
+	}, network::Framing::UNTIL_EOF, true};
+	network::EpollTcpServer second{first.getPort(), [this](StringView msg) {
+		received.push_back(msg.toString());
+	}, network::Framing::UNTIL_EOF, true};
+
+	const size_t CLIENTS{20};
+	for (size_t i = 0; i < CLIENTS; i++) {
+		int fd = connectToLocalPort(first.getPort());
+		ASSERT_NE(fd, -1);
+		ASSERT_EQ(send(fd, "OK", 2, 0), 2);
+		close(fd);
+	}
+
+	for (int i = 0; i < 100 && received.size() < CLIENTS; i++) {
+		first.poll(5);
+		second.poll(5);
+	}
+	ASSERT_EQ(received.size(), CLIENTS);
+}
+
+TEST_F(EpollTcpServerTest, reusePortAcceptorsShareDeduplicator) {
+	pipeline::Deduplicator deduplicator{64, chrono::milliseconds(10000)};
+	atomic<size_t> handled{0};
+	atomic<size_t> admitted{0};
+	auto ingest = [&](StringView msg) {
+		if (deduplicator.admit(msg))
+			admitted++;
+		handled++;
+	};
+	network::EpollTcpServer first{0, ingest, network::Framing::UNTIL_EOF, true};
+	network::EpollTcpServer second{first.getPort(), ingest,
+		network::Framing::UNTIL_EOF, true};
+
+	atomic<bool> stopping{false};
+	auto acceptor = [&](network::EpollTcpServer& server) {
+		while (!stopping)
+			server.poll(5);
+	};
+	thread firstThread(acceptor, ref(first));
+	thread secondThread(acceptor, ref(second));
+
+	// Retries come on new connections, which either acceptor may get.
+	const size_t DELIVERIES{20};
+	for (size_t i = 0; i < DELIVERIES; i++) {
+		int fd = connectToLocalPort(first.getPort());
+		ASSERT_NE(fd, -1);
+		ASSERT_EQ(send(fd, "{\"status\":\"FAILURE\"}", 20, 0), 20);
+		close(fd);
+		for (int j = 0; j < 1000 && handled < i + 1; j++)
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	stopping = true;
+	firstThread.join();
+	secondThread.join();
+
+	ASSERT_EQ(handled, DELIVERIES);
+	ASSERT_EQ(admitted, 1u);
+	ASSERT_EQ(deduplicator.getStats().duplicates, DELIVERIES - 1);
+}
+
+TEST_F(EpollTcpServerTest, emptyConnectionIsIgnored) {
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	close(fd);
+
+	for (int i = 0; i < 10; i++)
+		server.poll(10);
+	ASSERT_TRUE(received.empty());
+	ASSERT_EQ(server.getOpenConnections(), 0u);
+}
+
+class UringTcpServerTest : public ::testing::Test {
+protected:
+	void SetUp() override {
+		if (!network::UringTcpServer::isSupported())
+			GTEST_SKIP() << "kernel without io_uring";
+	}
+
+	void pollUntilReceived(network::StreamServer& server, size_t count) {
+		for (int i = 0; i < 100 && received.size() < count; i++)
+			server.poll(10);
+	}
+
+	vector<string> received;
+	network::StreamServer::MessageHandler handler{[this](StringView msg) {
+		received.push_back(msg.toString());
+	}};
+};
+
+TEST_F(UringTcpServerTest, receivesMessagesLargerThanBuffer) {
+	network::UringTcpServer server{0, handler};
+
+	string large(3 * network::BufferPool::CHUNK_SIZE + 10, 'x');
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, large.data(), large.size(), 0), (ssize_t)large.size());
+	close(fd);
+	fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, "SUCCESS", 7, 0), 7);
+	close(fd);
+
+	pollUntilReceived(server, 2);
+	ASSERT_THAT(received, UnorderedElementsAre(large, "SUCCESS"));
+}
+
+TEST_F(UringTcpServerTest, delimitedMessages) {
+	network::UringTcpServer server{0, handler, network::Framing::DELIMITED};
+
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, "OK\nFAIL", 7, 0), 7);
+	pollUntilReceived(server, 1);
+	ASSERT_EQ(send(fd, "URE\n", 4, 0), 4);
+	close(fd);
+
+	pollUntilReceived(server, 2);
+	ASSERT_THAT(received, ElementsAre("OK", "FAILURE"));
+}
+
+TEST_F(UringTcpServerTest, httpKeepAlive) {
+	network::UringTcpServer server{0, handler, network::Framing::HTTP};
+
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+
+	string request{"POST / HTTP/1.1\r\nContent-Length: 7\r\n\r\nSUCCESS"};
+	string response;
+	char buf[256];
+	for (int i = 0; i < 2; i++) {
+		ASSERT_EQ(send(fd, request.data(), request.size(), 0), (ssize_t)request.size());
+		for (int j = 0; j < 100 && response.size() < (i + 1) * network::HTTP_RESPONSE_OK.size(); j++) {
+			server.poll(10);
+			ssize_t size = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (size > 0)
+				response.append(buf, size);
+		}
+	}
+	close(fd);
+
+	ASSERT_THAT(received, ElementsAre("SUCCESS", "SUCCESS"));
+	ASSERT_EQ(response, network::HTTP_RESPONSE_OK.toString() + network::HTTP_RESPONSE_OK.toString());
+}
+
+TEST_F(UringTcpServerTest, rawMessageOnHttpPort) {
+	network::UringTcpServer server{0, handler, network::Framing::HTTP};
+
+	int fd = connectToLocalPort(server.getPort());
+	ASSERT_NE(fd, -1);
+	ASSERT_EQ(send(fd, "FAILURE", 7, 0), 7);
+	close(fd);
+
+	pollUntilReceived(server, 1);
+	ASSERT_THAT(received, ElementsAre("FAILURE"));
+}
+
+TEST_F(UringTcpServerTest, watchIsLevelTriggered) {
+	network::UringTcpServer server{0, handler};
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	server.watch(fds[0], [&]() {
+		char c;
+		if (read(fds[0], &c, 1) == 1)
+			received.push_back(string(1, c));
+	});
+
+	ASSERT_EQ(write(fds[1], "ab", 2), 2);
+	pollUntilReceived(server, 2);
+	ASSERT_THAT(received, ElementsAre("a", "b"));
+	close(fds[0]);
+	close(fds[1]);
+}
+
+TEST_F(UringTcpServerTest, backsOffWhileOutOfFds) {
+	network::UringTcpServer server{0, handler};
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_NE(client, -1);
+
+	// No fd is left for accepting.
+	struct rlimit limit;
+	ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+	struct rlimit lowered = limit;
+	lowered.rlim_cur = dup(client);
+	close(lowered.rlim_cur);
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &lowered), 0);
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(server.getPort());
+	ASSERT_EQ(connect(client, (struct sockaddr*)&address, sizeof(address)), 0);
+
+	size_t syscalls = server.getSyscallCount();
+	auto end = chrono::steady_clock::now() + chrono::milliseconds(300);
+	while (chrono::steady_clock::now() < end)
+		server.poll(10);
+	ASSERT_LT(server.getSyscallCount() - syscalls, 100u);
+
+	ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+	ASSERT_EQ(send(client, "OK", 2, 0), 2);
+	close(client);
+	pollUntilReceived(server, 1);
+	ASSERT_THAT(received, ElementsAre("OK"));
+}
+
+TEST_F(UringTcpServerTest, preferredByFactory) {
+	auto server = network::makeTcpServer(0, handler);
+	ASSERT_NE(dynamic_cast<network::UringTcpServer*>(server.get()), nullptr);
+}
+
 } // namespace
@@ -0,0 +1,442 @@
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace network {
+
+#ifdef IORING_ACCEPT_MULTISHOT
+
+namespace {
+
+enum Operation : uint64_t {
+	ACCEPT = 1,
+	RECV = 2,
+	CLOSE = 3,
+	WATCH = 4,
+	ACCEPT_RETRY = 5
+};
+
+// After accept errors, which tend to persist (e.g. EMFILE).
+const struct __kernel_timespec ACCEPT_RETRY_DELAY{0, 100 * 1000 * 1000};
+
+// The low half is the fd, or for WATCH the index into watched.
+uint64_t makeUserData(Operation op, int fd) {
+	return ((uint64_t)op << 32) | (uint32_t)fd;
+}
+
+int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+		unsigned flags, struct io_uring_getevents_arg* arg) {
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+			arg ? sizeof(*arg) : 0);
+}
+
+int ioUringRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+unsigned* ringField(void* ring, unsigned offset) {
+	return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+} // namespace
+
+UringTcpServer::UringTcpServer(uint16_t port, MessageHandler handler,
+		Framing framing, bool reusePort) :
+	handler(handler),
+	framing(framing) {
+
+	try {
+		setupRing();
+		setupBuffers();
+		setupListenSocket(port, reusePort);
+	} catch (...) {
+		teardown();
+		throw;
+	}
+	armAccept();
+}
+
+UringTcpServer::~UringTcpServer() {
+	teardown();
+}
+
+bool UringTcpServer::isSupported() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = ioUringSetup(1, &params);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+void UringTcpServer::setupRing() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringFd = ioUringSetup(RING_ENTRIES, &params);
+	if (ringFd < 0)
+		throw std::runtime_error("io_uring_setup failed.");
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(params.features & IORING_FEAT_EXT_ARG))
+		throw std::runtime_error("io_uring lacks single mmap or wait timeouts.");
+
+	// With a single mmap, the CQ ring shares the mapping of the SQ ring.
+	size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	sqRingSize = std::max(sqRingSize, cqRingSize);
+	sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if (sqRing == MAP_FAILED) {
+		sqRing = nullptr;
+		throw std::runtime_error("cannot map io_uring.");
+	}
+	void* cqRing = sqRing;
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if (sqesMap == MAP_FAILED)
+		throw std::runtime_error("cannot map io_uring entries.");
+	sqes = static_cast<struct io_uring_sqe*>(sqesMap);
+
+	sqHead = ringField(sqRing, params.sq_off.head);
+	sqTail = ringField(sqRing, params.sq_off.tail);
+	sqMask = *ringField(sqRing, params.sq_off.ring_mask);
+	sqEntries = params.sq_entries;
+	sqArray = ringField(sqRing, params.sq_off.array);
+	sqLocalTail = *sqTail;
+
+	cqHead = ringField(cqRing, params.cq_off.head);
+	cqTail = ringField(cqRing, params.cq_off.tail);
+	cqMask = *ringField(cqRing, params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(
+			static_cast<char*>(cqRing) + params.cq_off.cqes);
+}
+
+void UringTcpServer::setupBuffers() {
+	// The kernel picks recv buffers from a ring shared with us, so handing
+	// one back is a store to the ring's tail instead of an SQE.
+	bufferRingSize = BUFFER_COUNT * sizeof(struct io_uring_buf);
+	void* ring = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring == MAP_FAILED)
+		throw std::runtime_error("cannot map buffer ring.");
+	bufferRing = static_cast<struct io_uring_buf_ring*>(ring);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+	reg.ring_entries = BUFFER_COUNT;
+	reg.bgid = BUFFER_GROUP;
+	if (ioUringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		throw std::runtime_error("cannot register buffer ring.");
+
+	buffers.resize(BUFFER_COUNT * BUFFER_SIZE);
+	for (unsigned id = 0; id < BUFFER_COUNT; id++)
+		provideBuffer(id);
+}
+
+void UringTcpServer::setupListenSocket(uint16_t port, bool reusePort) {
+	listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenSocket == -1)
+		throw std::runtime_error("cannot create socket.");
+
+	const int optVal{1};
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+	if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT,
+				&optVal, sizeof(int)) != 0)
+		throw std::runtime_error("cannot set SO_REUSEPORT.");
+
+	struct sockaddr_in listenAddress;
+	memset(&listenAddress, 0, sizeof(listenAddress));
+	listenAddress.sin_family = AF_INET;
+	listenAddress.sin_addr.s_addr = INADDR_ANY;
+	listenAddress.sin_port = htons(port);
+	if (bind(listenSocket, (struct sockaddr *) &listenAddress,
+				sizeof (listenAddress)) != 0)
+		throw std::runtime_error("bind error: cannot listen on port.");
+
+	if (listen(listenSocket, SOMAXCONN) != 0)
+		throw std::runtime_error("listen error.");
+}
+
+void UringTcpServer::teardown() {
+	for (size_t fd = 0; fd < connections.size(); fd++) {
+		if (connections[fd].isOpen())
+			close(fd);
+	}
+	connections.clear();
+
+	if (listenSocket != -1)
+		close(listenSocket);
+	if (bufferRing)
+		munmap(bufferRing, bufferRingSize);
+	if (sqes)
+		munmap(sqes, sqesSize);
+	if (sqRing)
+		munmap(sqRing, sqRingSize);
+	if (ringFd >= 0)
+		close(ringFd);
+
+	listenSocket = -1;
+	bufferRing = nullptr;
+	sqes = nullptr;
+	sqRing = nullptr;
+	ringFd = -1;
+}
+
+void UringTcpServer::poll(int timeoutMs) {
+	enter(timeoutMs != 0 ? 1 : 0, timeoutMs);
+	processCompletions();
+}
+
+void UringTcpServer::watch(int fd, ReadableHandler readableHandler) {
+	watched.push_back(std::make_pair(fd, readableHandler));
+	armWatch(watched.size() - 1);
+}
+
+uint16_t UringTcpServer::getPort() {
+	struct sockaddr_in address;
+	socklen_t addrlen{sizeof(address)};
+	if (getsockname(listenSocket, (struct sockaddr*)&address, &addrlen) != 0)
+		throw std::runtime_error("error on getsockname()");
+	return ntohs(address.sin_port);
+}
+
+size_t UringTcpServer::getSyscallCount() {
+	return syscallCount;
+}
+
+struct io_uring_sqe* UringTcpServer::getSqe() {
+	unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+	if (sqLocalTail - head == sqEntries)
+		enter(0, 0);
+
+	unsigned idx = sqLocalTail & sqMask;
+	struct io_uring_sqe* sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[idx] = idx;
+	sqLocalTail++;
+	pendingSubmissions++;
+	return sqe;
+}
+
+void UringTcpServer::enter(unsigned minComplete, int timeoutMs) {
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+
+	// Completions that are already there need no waiting.
+	if (minComplete && __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) != *cqHead)
+		minComplete = 0;
+	if (pendingSubmissions == 0 && minComplete == 0)
+		return;
+
+	unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec timeout;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (minComplete && timeoutMs > 0) {
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+		arg.ts = (uint64_t)(uintptr_t)&timeout;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	int submitted = ioUringEnter(ringFd, pendingSubmissions, minComplete,
+			flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr);
+	syscallCount++;
+	if (submitted < 0) {
+		if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return;
+		throw std::runtime_error("io_uring_enter failed.");
+	}
+	pendingSubmissions -= std::min((unsigned)submitted, pendingSubmissions);
+}
+
+void UringTcpServer::processCompletions() {
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe* cqe = &cqes[head & cqMask];
+		auto op = static_cast<Operation>(cqe->user_data >> 32);
+		int fd = (int)(cqe->user_data & 0xffffffff);
+		int result = cqe->res;
+		unsigned flags = cqe->flags;
+		head++;
+
+		if (op == ACCEPT) {
+			handleAccept(result, flags);
+		} else if (op == RECV) {
+			handleRecv(fd, result, flags);
+		} else if (op == ACCEPT_RETRY) {
+			armAccept();
+		} else if (op == WATCH) {
+			// Re-armed one-shot polls are level-triggered, like in epoll.
+			watched[fd].second();
+			armWatch(fd);
+		}
+	}
+
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringTcpServer::handleAccept(int result, unsigned flags) {
+	if (result >= 0) {
+		int fd = result;
+		while ((size_t)fd >= connections.size())
+			connections.emplace_back(pool, framing);
+		connections[fd].open(fd);
+		armRecv(fd);
+	} else {
+		printf("ERROR on accept(): %s.\n", strerror(-result));
+	}
+
+	// The multishot accept ends on errors (e.g. no more fds). Re-armed at
+	// once, it would fail again right away.
+	if (!(flags & IORING_CQE_F_MORE)) {
+		if (result >= 0 || result == -ECONNABORTED || result == -EINTR)
+			armAccept();
+		else
+			armAcceptRetry();
+	}
+}
+
+void UringTcpServer::handleRecv(int fd, int result, unsigned flags) {
+	StreamConnection& connection = connections[fd];
+
+	if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+		unsigned bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+		bool open = connection.append(&buffers[bufferId * BUFFER_SIZE], result,
+				handler);
+		provideBuffer(bufferId);
+
+		if (open)
+			armRecv(fd);
+		else
+			closeConnection(fd);
+	} else if (result == 0) {
+		connection.finish(handler);
+		closeConnection(fd);
+	} else if (result == -ENOBUFS) {
+		// All buffers are taken; the ones handed back since are in the
+		// ring again.
+		armRecv(fd);
+	} else {
+		closeConnection(fd);
+	}
+}
+
+void UringTcpServer::armAccept() {
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenSocket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = makeUserData(ACCEPT, listenSocket);
+}
+
+void UringTcpServer::armAcceptRetry() {
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)&ACCEPT_RETRY_DELAY;
+	sqe->len = 1;
+	sqe->user_data = makeUserData(ACCEPT_RETRY, listenSocket);
+}
+
+void UringTcpServer::armRecv(int fd) {
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = BUFFER_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = makeUserData(RECV, fd);
+}
+
+void UringTcpServer::armWatch(size_t index) {
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = watched[index].first;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = makeUserData(WATCH, index);
+}
+
+void UringTcpServer::closeConnection(int fd) {
+	connections[fd].close();
+
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = makeUserData(CLOSE, fd);
+}
+
+void UringTcpServer::provideBuffer(unsigned id) {
+	// Not bufs[]: as C++, its empty-struct prefix moves it by 8 bytes.
+	struct io_uring_buf* buffer = reinterpret_cast<struct io_uring_buf*>(
+			bufferRing) + (bufferRingTail & (BUFFER_COUNT - 1));
+	buffer->addr = (uint64_t)(uintptr_t)&buffers[id * BUFFER_SIZE];
+	buffer->len = BUFFER_SIZE;
+	buffer->bid = id;
+	bufferRingTail++;
+	__atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+#else // IORING_ACCEPT_MULTISHOT
+
+UringTcpServer::UringTcpServer(uint16_t port, MessageHandler handler,
+		Framing framing, bool reusePort) {
+	(void)port;
+	(void)handler;
+	(void)framing;
+	(void)reusePort;
+	throw std::runtime_error("built without io_uring support.");
+}
+
+UringTcpServer::~UringTcpServer() {
+}
+
+bool UringTcpServer::isSupported() {
+	return false;
+}
+
+void UringTcpServer::poll(int timeoutMs) {
+	(void)timeoutMs;
+}
+
+void UringTcpServer::watch(int fd, ReadableHandler readableHandler) {
+	(void)fd;
+	(void)readableHandler;
+}
+
+uint16_t UringTcpServer::getPort() {
+	return 0;
+}
+
+size_t UringTcpServer::getSyscallCount() {
+	return 0;
+}
+
+#endif // IORING_ACCEPT_MULTISHOT
+
+std::unique_ptr<StreamServer> makeTcpServer(uint16_t port,
+		StreamServer::MessageHandler handler, Framing framing, bool reusePort) {
+	if (!UringTcpServer::isSupported()) {
+		printf("io_uring not available, using epoll.\n");
+		return std::make_unique<EpollTcpServer>(port, handler, framing, reusePort);
+	}
+
+	try {
+		return std::make_unique<UringTcpServer>(port, handler, framing, reusePort);
+	} catch (const std::runtime_error& e) {
+		printf("io_uring not usable (%s), using epoll.\n", e.what());
+	}
+	return std::make_unique<EpollTcpServer>(port, handler, framing, reusePort);
+}
+
+} // namespace network
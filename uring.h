@@ -0,0 +1,119 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "network.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+namespace network {
+
+/**
+ * StreamServer on io_uring: a multishot accept, recv into buffers from a
+ * registered buffer ring and batched submission, so a single
+ * io_uring_enter() submits all pending work and reaps all completions.
+ * Watched file descriptors are polled through the ring as well. HTTP
+ * responses are sent with plain send(), as by EpollTcpServer.
+ *
+ * Needs Linux 5.19 (multishot accept, buffer rings); the constructor
+ * throws std::runtime_error otherwise, see makeTcpServer().
+ */
+class UringTcpServer : public StreamServer {
+public:
+	/**
+	 * Port 0 binds to an ephemeral port, see getPort(). For reusePort see
+	 * EpollTcpServer.
+	 */
+	UringTcpServer(uint16_t port, MessageHandler handler,
+			Framing framing = Framing::UNTIL_EOF, bool reusePort = false);
+	~UringTcpServer();
+
+	UringTcpServer(const UringTcpServer&) = delete;
+	UringTcpServer& operator=(const UringTcpServer&) = delete;
+
+	/**
+	 * Whether io_uring_setup() succeeds here; it may be missing, or
+	 * disabled by sysctl or a seccomp filter.
+	 */
+	static bool isSupported();
+
+	void poll(int timeoutMs) override;
+	void watch(int fd, ReadableHandler readableHandler) override;
+	uint16_t getPort() override;
+
+	size_t getSyscallCount();
+
+private:
+	void setupRing();
+	void setupBuffers();
+	void setupListenSocket(uint16_t port, bool reusePort);
+	void teardown();
+
+	io_uring_sqe* getSqe();
+	void enter(unsigned minComplete, int timeoutMs);
+	void processCompletions();
+	void handleAccept(int result, unsigned flags);
+	void handleRecv(int fd, int result, unsigned flags);
+
+	void armAccept();
+	void armAcceptRetry();
+	void armRecv(int fd);
+	void armWatch(size_t index);
+	void closeConnection(int fd);
+	void provideBuffer(unsigned id);
+
+private:
+	static const unsigned RING_ENTRIES{256};
+	static const unsigned BUFFER_COUNT{64}; // a power of two
+	static const unsigned BUFFER_SIZE{4096};
+	static const unsigned BUFFER_GROUP{0};
+	static const size_t CHUNKS_RETAINED_MAX{256};
+
+	MessageHandler handler;
+	Framing framing;
+	int ringFd{-1};
+	int listenSocket{-1};
+
+	void* sqRing{nullptr};
+	size_t sqRingSize{0};
+	io_uring_sqe* sqes{nullptr};
+	size_t sqesSize{0};
+
+	unsigned* sqHead{nullptr};
+	unsigned* sqTail{nullptr};
+	unsigned sqMask{0};
+	unsigned sqEntries{0};
+	unsigned* sqArray{nullptr};
+	unsigned sqLocalTail{0};
+	unsigned pendingSubmissions{0};
+
+	unsigned* cqHead{nullptr};
+	unsigned* cqTail{nullptr};
+	unsigned cqMask{0};
+	io_uring_cqe* cqes{nullptr};
+
+	io_uring_buf_ring* bufferRing{nullptr};
+	size_t bufferRingSize{0};
+	uint16_t bufferRingTail{0};
+	std::vector<char> buffers;
+
+	BufferPool pool{CHUNKS_RETAINED_MAX};
+	std::vector<StreamConnection> connections; // indexed by file descriptor
+	std::vector<std::pair<int, ReadableHandler>> watched;
+	size_t syscallCount{0};
+};
+
+/**
+ * Creates the io_uring server if the kernel supports it, the
+ * EpollTcpServer otherwise.
+ */
+std::unique_ptr<StreamServer> makeTcpServer(uint16_t port,
+		StreamServer::MessageHandler handler,
+		Framing framing = Framing::UNTIL_EOF, bool reusePort = false);
+
+} // namespace network